@@ -5,6 +5,7 @@
 #include "stream.hpp"
 #include "cpp/vg.pb.h"
 #include "xg.hpp"
+#include "sharded_xg.hpp"
 
 using namespace std;
 using namespace sdsl;
@@ -17,14 +18,26 @@ void help_main(char** argv) {
          << endl
          << "options:" << endl
          << "    -v, --vg FILE        compress graph in vg FILE" << endl
+         << "    -g, --gfa FILE       compress graph in GFA FILE" << endl
+         << "    -M, --merge FILE     merge the index in FILE into the graph (may repeat)" << endl
          << "    -V, --validate       validate compression" << endl
+         << "    -q, --validate-fraction F  validate only a random fraction F of the graph (implies -V)" << endl
          << "    -o, --out FILE       serialize graph to FILE" << endl
          << "    -i, --in FILE        use index in FILE" << endl
+         << "    -N, --dense-node-starts    keep node starts in a plain array, for faster node lookups" << endl
+         << "    -I, --index-sequence also build an FM-index over the node sequences" << endl
+         << "    -H, --shard FILE     answer the queries below from the index in FILE and any other" << endl
+         << "                         shards given (may repeat; use instead of -i)" << endl
+         << "    -K, --max-shards N   keep at most N shards loaded at once (default: no limit)" << endl
+         << "    -C, --check FILE     verify the section checksums of the index in FILE, without loading it" << endl
          << "    -n, --node ID        graph neighborhood around node with ID" << endl
          << "    -c, --context N      steps of context to extract when building neighborhood" << endl
          << "    -s, --node-seq ID    provide node sequence for ID" << endl
          << "    -P, --char POS       give the character at a given position in the graph" << endl
          << "    -F, --substr POS:LEN extract the substr of LEN on the node at the position" << endl
+         << "    -l, --locate SEQ     list the node:offset positions where SEQ occurs (needs -I)" << endl
+         << "    -a, --follow HANDLE  list the handles (ID+ or ID-) before and after HANDLE" << endl
+         << "    -k, --follow-limit N list at most N handles on each side with -a" << endl
          << "    -f, --edges-from ID  list edges from node with ID" << endl
          << "    -t, --edges-to ID    list edges to node with ID" << endl
          << "    -O, --edges-of ID    list all edges related to node with ID" << endl
@@ -34,6 +47,9 @@ void help_main(char** argv) {
          << "    -x, --extract-threads      extract succinct threads as paths" << endl
          << "    -r, --store-threads  store perfect match paths as succinct threads" << endl
          << "    -d, --is-sorted-dag  graph is a sorted dag; use fast thread insert" << endl
+         << "    -m, --max-memory N   build out of core, buffering at most N MB of graph in memory" << endl
+         << "                         (spills to $TMPDIR, or /tmp)" << endl
+         << "    -j, --threads N      use N threads when building (default: all available)" << endl
          << "    -R, --report FILE    save an HTML space usage report to FILE when serializing" << endl
          << "    -D, --debug          show debugging output" << endl
          << "    -T, --text-output    write text instead of vg protobuf" << endl
@@ -41,6 +57,84 @@ void help_main(char** argv) {
          << "    -h, --help           this text" << endl;
 }
 
+void print_edges(const vector<Edge>& edges) {
+    for (auto& edge : edges) {
+        cout << edge.from() << (edge.from_start()?"-":"+")
+             << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
+    }
+}
+
+// Answer the queries that both a single index and a set of shards support.
+template<typename Index>
+void answer_queries(const Index& graph, int64_t node_id, bool node_sequence,
+                    const string& pos_for_char, const string& pos_for_substr,
+                    bool edges_from, bool edges_to, bool edges_of,
+                    bool edges_on_start, bool edges_on_end,
+                    bool node_context, int context_steps, const string& target,
+                    bool text_output) {
+    if (node_sequence) {
+        cout << node_id << ": " << graph.node_sequence(node_id) << endl;
+    }
+    if (!pos_for_char.empty()) {
+        // extract the position from the string
+        int64_t id;
+        bool is_rev;
+        size_t off;
+        extract_pos(pos_for_char, id, is_rev, off);
+        // then pick it up from the graph
+        cout << graph.pos_char(id, is_rev, off) << endl;
+    }
+    if (!pos_for_substr.empty()) {
+        int64_t id;
+        bool is_rev;
+        size_t off;
+        size_t len;
+        extract_pos_substr(pos_for_substr, id, is_rev, off, len);
+        cout << graph.pos_substr(id, is_rev, off, len) << endl;
+    }
+    if (edges_from) {
+        print_edges(graph.edges_from(node_id));
+    }
+    if (edges_to) {
+        print_edges(graph.edges_to(node_id));
+    }
+    if (edges_of) {
+        print_edges(graph.edges_of(node_id));
+    }
+    if (edges_on_start) {
+        print_edges(graph.edges_on_start(node_id));
+    }
+    if (edges_on_end) {
+        print_edges(graph.edges_on_end(node_id));
+    }
+
+    if (node_context) {
+        Graph g;
+        graph.neighborhood(node_id, context_steps, g);
+        if (text_output) {
+            to_text(cout, g);
+        } else {
+            vector<Graph> gb = { g };
+            stream::write_buffered(cout, gb, 0);
+        }
+    }
+
+    if (!target.empty()) {
+        string name;
+        int64_t start, end;
+        Graph g;
+        parse_region(target, name, start, end);
+        graph.get_path_range(name, start, end, g);
+        graph.expand_context(g, context_steps);
+        if (text_output) {
+            to_text(cout, g);
+        } else {
+            vector<Graph> gb = { g };
+            stream::write_buffered(cout, gb, 0);
+        }
+    }
+}
+
 int main(int argc, char** argv) {
 
     if (argc == 1) {
@@ -49,8 +143,13 @@ int main(int argc, char** argv) {
     }
 
     string vg_name;
+    string gfa_name;
+    vector<string> merge_names;
     string out_name;
     string in_name;
+    string check_name;
+    vector<string> shard_names;
+    size_t max_shards = 0;
     int64_t node_id;
     bool edges_from = false;
     bool edges_to = false;
@@ -66,9 +165,17 @@ int main(int argc, char** argv) {
     bool print_graph = false;
     bool text_output = false;
     bool validate_graph = false;
+    double validate_fraction = 1.0;
+    bool dense_node_starts = false;
+    bool index_sequence = false;
+    string locate_pattern;
+    string follow_handle;
+    size_t follow_limit = 0;
     bool extract_threads = false;
     bool store_threads = false;
     bool is_sorted_dag = false;
+    size_t build_memory_budget = 0;
+    int threads = 0;
     string report_name;
     string b_array_name;
     
@@ -79,6 +186,8 @@ int main(int argc, char** argv) {
             {
                 {"help", no_argument, 0, 'h'},
                 {"vg", required_argument, 0, 'v'},
+                {"gfa", required_argument, 0, 'g'},
+                {"merge", required_argument, 0, 'M'},
                 {"out", required_argument, 0, 'o'},
                 {"in", required_argument, 0, 'i'},
                 {"node", required_argument, 0, 'n'},
@@ -96,16 +205,27 @@ int main(int argc, char** argv) {
                 {"extract-threads", no_argument, 0, 'x'},
                 {"store-threads", no_argument, 0, 'r'},
                 {"is-sorted-dag", no_argument, 0, 'd'},
+                {"max-memory", required_argument, 0, 'm'},
+                {"threads", required_argument, 0, 'j'},
                 {"report", required_argument, 0, 'R'},
                 {"debug", no_argument, 0, 'D'},
                 {"text-output", no_argument, 0, 'T'},
                 {"validate", no_argument, 0, 'V'},
+                {"check", required_argument, 0, 'C'},
+                {"validate-fraction", required_argument, 0, 'q'},
+                {"dense-node-starts", no_argument, 0, 'N'},
+                {"index-sequence", no_argument, 0, 'I'},
+                {"locate", required_argument, 0, 'l'},
+                {"shard", required_argument, 0, 'H'},
+                {"follow", required_argument, 0, 'a'},
+                {"follow-limit", required_argument, 0, 'k'},
+                {"max-shards", required_argument, 0, 'K'},
                 {"dump-bs", required_argument, 0, 'b'},
                 {0, 0, 0, 0}
             };
 
         int option_index = 0;
-        c = getopt_long (argc, argv, "hv:o:i:f:t:s:c:n:p:DxrdTO:S:E:VR:P:F:b:",
+        c = getopt_long (argc, argv, "hv:g:M:o:i:C:f:t:s:c:n:p:DxrdTO:S:E:Vq:NIl:H:K:a:k:R:P:F:b:m:j:",
                          long_options, &option_index);
 
         // Detect the end of the options.
@@ -119,10 +239,51 @@ int main(int argc, char** argv) {
             vg_name = optarg;
             break;
 
+        case 'g':
+            gfa_name = optarg;
+            break;
+
+        case 'M':
+            merge_names.push_back(optarg);
+            break;
+
         case 'V':
             validate_graph = true;
             break;
 
+        case 'q':
+            validate_graph = true;
+            validate_fraction = atof(optarg);
+            break;
+
+        case 'N':
+            dense_node_starts = true;
+            break;
+
+        case 'I':
+            index_sequence = true;
+            break;
+
+        case 'l':
+            locate_pattern = optarg;
+            break;
+
+        case 'H':
+            shard_names.push_back(optarg);
+            break;
+
+        case 'K':
+            max_shards = atol(optarg);
+            break;
+
+        case 'a':
+            follow_handle = optarg;
+            break;
+
+        case 'k':
+            follow_limit = atol(optarg);
+            break;
+
         case 'o':
             out_name = optarg;
             break;
@@ -147,6 +308,14 @@ int main(int argc, char** argv) {
             is_sorted_dag = true;
             break;
 
+        case 'm':
+            build_memory_budget = (size_t) atol(optarg) * 1024 * 1024;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            break;
+
         case 'i':
             in_name = optarg;
             break;
@@ -205,6 +374,10 @@ int main(int argc, char** argv) {
         case 'R':
             report_name = optarg;
             break;
+
+        case 'C':
+            check_name = optarg;
+            break;
             
         case 'b':
             b_array_name = optarg;
@@ -221,27 +394,100 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (threads > 0) {
+        omp_set_num_threads(threads);
+    }
+
+    if (!check_name.empty()) {
+        if (!XG::verify_file(check_name, cerr)) {
+            return 1;
+        }
+        cerr << check_name << ": ok" << endl;
+        return 0;
+    }
+
+    if (!shard_names.empty()) {
+        ShardedXG sharded(max_shards);
+        try {
+            for (auto& shard_name : shard_names) {
+                sharded.add_shard(shard_name);
+            }
+            answer_queries(sharded, node_id, node_sequence, pos_for_char, pos_for_substr,
+                           edges_from, edges_to, edges_of, edges_on_start, edges_on_end,
+                           node_context, context_steps, target, text_output);
+        } catch (const XGFormatError& e) {
+            cerr << "[xg] error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
     XG* graph = nullptr;
     //string file_name = argv[optind];
-    if (in_name.empty()) assert(!vg_name.empty());
+    if (in_name.empty()) assert(!vg_name.empty() || !gfa_name.empty() || !merge_names.empty());
     if (vg_name == "-") {
         graph = new XG;
-        graph->from_stream(std::cin, validate_graph, print_graph, store_threads, is_sorted_dag);
+        graph->validate_fraction = validate_fraction;
+        graph->index_sequence = index_sequence;
+        graph->dense_node_starts = dense_node_starts;
+        graph->from_stream(std::cin, validate_graph, print_graph, store_threads, is_sorted_dag,
+                           build_memory_budget);
     } else if (vg_name.size()) {
         ifstream in;
         in.open(vg_name.c_str());
         graph = new XG;
-        graph->from_stream(in, validate_graph, print_graph, store_threads, is_sorted_dag);
+        graph->validate_fraction = validate_fraction;
+        graph->index_sequence = index_sequence;
+        graph->dense_node_starts = dense_node_starts;
+        graph->from_stream(in, validate_graph, print_graph, store_threads, is_sorted_dag,
+                           build_memory_budget);
+    }
+
+    if (gfa_name == "-") {
+        graph = new XG;
+        graph->validate_fraction = validate_fraction;
+        graph->index_sequence = index_sequence;
+        graph->dense_node_starts = dense_node_starts;
+        graph->from_gfa(std::cin, validate_graph, print_graph, store_threads, is_sorted_dag,
+                        build_memory_budget);
+    } else if (gfa_name.size()) {
+        ifstream in;
+        in.open(gfa_name.c_str());
+        graph = new XG;
+        graph->validate_fraction = validate_fraction;
+        graph->index_sequence = index_sequence;
+        graph->dense_node_starts = dense_node_starts;
+        graph->from_gfa(in, validate_graph, print_graph, store_threads, is_sorted_dag,
+                        build_memory_budget);
+    }
+
+    if (merge_names.size()) {
+        vector<const XG*> parts;
+        for (auto& merge_name : merge_names) {
+            // Merging never reads the threads, so leave them on disk.
+            XG* part = new XG;
+            part->load(merge_name, 0);
+            parts.push_back(part);
+        }
+        graph = new XG;
+        graph->validate_fraction = validate_fraction;
+        graph->index_sequence = index_sequence;
+        graph->dense_node_starts = dense_node_starts;
+        graph->merge(parts, validate_graph, print_graph, store_threads, is_sorted_dag,
+                     build_memory_budget);
+        for (auto part : parts) {
+            delete part;
+        }
     }
 
     if (in_name.size()) {
         graph = new XG;
+        graph->dense_node_starts = dense_node_starts;
         if (in_name == "-") {
             graph->load(std::cin);
         } else {
-            ifstream in;
-            in.open(in_name.c_str());
-            graph->load(in);
+            // Paths and threads are only loaded if something needs them.
+            graph->load(in_name, 0);
         }
     }
 
@@ -274,89 +520,36 @@ int main(int argc, char** argv) {
     }
 
     // queries
-    if (node_sequence) {
-        cout << node_id << ": " << graph->node_sequence(node_id) << endl;
-    }
-    if (!pos_for_char.empty()) {
-        // extract the position from the string
-        int64_t id;
-        bool is_rev;
-        size_t off;
-        extract_pos(pos_for_char, id, is_rev, off);
-        // then pick it up from the graph
-        cout << graph->pos_char(id, is_rev, off) << endl;
-    }
-    if (!pos_for_substr.empty()) {
-        int64_t id;
-        bool is_rev;
-        size_t off;
-        size_t len;
-        extract_pos_substr(pos_for_substr, id, is_rev, off, len);
-        cout << graph->pos_substr(id, is_rev, off, len) << endl;
-    }
-    
-    if (edges_from) {
-        vector<Edge> edges = graph->edges_from(node_id);
-        for (auto& edge : edges) {
-            cout << edge.from() << (edge.from_start()?"-":"+")
-                 << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
+    answer_queries(*graph, node_id, node_sequence, pos_for_char, pos_for_substr,
+                   edges_from, edges_to, edges_of, edges_on_start, edges_on_end,
+                   node_context, context_steps, target, text_output);
+
+    if (!locate_pattern.empty()) {
+        if (!graph->has_sequence_index()) {
+            cerr << "[xg] error: the index has no sequence FM-index; build it with -I" << endl;
+            return 1;
         }
-    }
-    if (edges_to) {
-        vector<Edge> edges = graph->edges_to(node_id);
-        for (auto& edge : edges) {
-            cout << edge.from() << (edge.from_start()?"-":"+")
-                 << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
-        }
-    }
-    if (edges_of) {
-        vector<Edge> edges = graph->edges_of(node_id);
-        for (auto& edge : edges) {
-            cout << edge.from() << (edge.from_start()?"-":"+")
-                 << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
+        auto found = graph->locate_sequence(locate_pattern);
+        std::sort(found.begin(), found.end());
+        for (auto& occurrence : found) {
+            cout << occurrence.first << ":" << occurrence.second << endl;
         }
     }
-    if (edges_on_start) {
-        vector<Edge> edges = graph->edges_on_start(node_id);
-        for (auto& edge : edges) {
-            cout << edge.from() << (edge.from_start()?"-":"+")
-                 << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
-        }
-    }
-    if (edges_on_end) {
-        vector<Edge> edges = graph->edges_on_end(node_id);
-        for (auto& edge : edges) {
-            cout << edge.from() << (edge.from_start()?"-":"+")
-                 << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
-        }
-    }
-
-    if (node_context) {
-        Graph g;
-        graph->neighborhood(node_id, context_steps, g);
-        if (text_output) {
-            to_text(cout, g);
-        } else {
-            vector<Graph> gb = { g };
-            stream::write_buffered(cout, gb, 0);
+    
+    if (!follow_handle.empty()) {
+        bool is_reverse = follow_handle.back() == '-';
+        handle_t handle = graph->get_handle(atol(follow_handle.c_str()), is_reverse);
+        for (bool go_left : {true, false}) {
+            cout << (go_left ? "left " : "right ") << graph->degree(handle, go_left) << ":";
+            size_t listed = 0;
+            graph->follow_edges(handle, go_left, [&](const handle_t& next) {
+                cout << " " << graph->get_id(next) << (graph->get_is_reverse(next) ? "-" : "+");
+                return follow_limit == 0 || ++listed < follow_limit;
+            });
+            cout << endl;
         }
     }
 
-    if (!target.empty()) {
-        string name;
-        int64_t start, end;
-        Graph g;
-        parse_region(target, name, start, end);
-        graph->get_path_range(name, start, end, g);
-        graph->expand_context(g, context_steps);
-        if (text_output) {
-            to_text(cout, g);
-        } else {
-            vector<Graph> gb = { g };
-            stream::write_buffered(cout, gb, 0);
-        }
-    }
-    
     if (extract_threads) {
         list<XG::thread_t> threads;
         for (auto& p : graph->extract_threads(false)) {
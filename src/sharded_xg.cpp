@@ -0,0 +1,351 @@
+#include "sharded_xg.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace xg {
+
+ShardedXG::ShardedXG(size_t max_loaded) : max_loaded(max_loaded) {
+    // Nothing to do
+}
+
+ShardedXG::~ShardedXG(void) {
+    // The shared pointers clean up the shards
+}
+
+static shared_ptr<const XG> load_shard(const string& filename) {
+    // Paths and threads are still loaded up front, since add_shard needs the
+    // path names.
+    shared_ptr<XG> index(new XG);
+    try {
+        index->load(filename);
+    } catch (const XGFormatError& e) {
+        // Say which shard it was, and leave handling it to the caller.
+        throw XGFormatError("could not load shard " + filename + ": " + e.what());
+    }
+    return index;
+}
+
+void ShardedXG::add_shard(const string& filename) {
+    shared_ptr<const XG> index = load_shard(filename);
+
+    vector<string> path_names;
+    for (size_t rank = 1; rank <= index->max_path_rank(); ++rank) {
+        path_names.push_back(index->path_name(rank));
+    }
+
+    lock_guard<mutex> guard(shards_mutex);
+    if (index->max_node_rank() == 0) {
+        // An empty shard holds no IDs
+        register_shard(filename, 1, 0, path_names);
+    } else {
+        register_shard(filename, index->min_node_id(), index->max_node_id(), path_names);
+    }
+    // Keep it, since we have it
+    Shard& shard = shards.back();
+    shard.index = index;
+    lru.push_front(shards.size() - 1);
+    shard.lru_position = lru.begin();
+    evict();
+}
+
+void ShardedXG::add_shard(const string& filename, int64_t min_id, int64_t max_id,
+                          const vector<string>& path_names) {
+    lock_guard<mutex> guard(shards_mutex);
+    register_shard(filename, min_id, max_id, path_names);
+}
+
+void ShardedXG::register_shard(const string& filename, int64_t min_id, int64_t max_id,
+                               const vector<string>& path_names) {
+    size_t number = shards.size();
+    if (min_id <= max_id) {
+        for (auto other : shards_by_id) {
+            if (min_id <= shards[other].max_id && shards[other].min_id <= max_id) {
+                cerr << "[xg] error: shard " << filename << " overlaps the node IDs of shard "
+                     << shards[other].filename << endl;
+                exit(1);
+            }
+        }
+    }
+    for (auto& name : path_names) {
+        if (path_shards.count(name)) {
+            cerr << "[xg] error: path " << name << " is in both shard " << filename
+                 << " and shard " << shards[path_shards[name]].filename << endl;
+            exit(1);
+        }
+    }
+
+    Shard shard;
+    shard.filename = filename;
+    shard.min_id = min_id;
+    shard.max_id = max_id;
+    shard.path_rank_offset = path_count;
+    shard.path_count = path_names.size();
+    shard.lru_position = lru.end();
+    shards.push_back(shard);
+
+    if (min_id <= max_id) {
+        shards_by_id.push_back(number);
+        std::sort(shards_by_id.begin(), shards_by_id.end(),
+                  [&](size_t a, size_t b) { return shards[a].min_id < shards[b].min_id; });
+    }
+    for (auto& name : path_names) {
+        path_shards[name] = number;
+    }
+    path_count += path_names.size();
+}
+
+size_t ShardedXG::shard_count(void) const {
+    return shards.size();
+}
+
+size_t ShardedXG::loaded_shard_count(void) const {
+    lock_guard<mutex> guard(shards_mutex);
+    return lru.size();
+}
+
+void ShardedXG::unload_all(void) {
+    lock_guard<mutex> guard(shards_mutex);
+    lru.clear();
+    for (auto& shard : shards) {
+        shard.index.reset();
+        shard.lru_position = lru.end();
+    }
+}
+
+shared_ptr<const XG> ShardedXG::get(size_t number) const {
+    promise<shared_ptr<const XG>> loaded;
+    unique_lock<mutex> lock(shards_mutex);
+    Shard& shard = shards[number];
+    if (shard.index) {
+        // Mark it most recently used
+        lru.splice(lru.begin(), lru, shard.lru_position);
+        return shard.index;
+    }
+    if (shard.loading.valid()) {
+        // Someone else is loading it, so wait for them.
+        shared_future<shared_ptr<const XG>> pending = shard.loading;
+        lock.unlock();
+        return pending.get();
+    }
+    shard.loading = loaded.get_future().share();
+    string filename = shard.filename;
+    lock.unlock();
+
+    // Load without the lock, so queries to other shards go on meanwhile.
+    shared_ptr<const XG> index;
+    try {
+        index = load_shard(filename);
+    } catch (...) {
+        lock.lock();
+        shard.loading = shared_future<shared_ptr<const XG>>();
+        lock.unlock();
+        loaded.set_exception(current_exception());
+        throw;
+    }
+
+    // Publish it
+    lock.lock();
+    shard.index = index;
+    shard.loading = shared_future<shared_ptr<const XG>>();
+    lru.push_front(number);
+    shard.lru_position = lru.begin();
+    evict();
+    lock.unlock();
+    loaded.set_value(index);
+    return index;
+}
+
+void ShardedXG::evict(void) const {
+    // A limit of 0 means no limit. Otherwise the most recently used shard,
+    // at the front, is the last that could go, and a limit of 1 keeps it.
+    while (max_loaded != 0 && lru.size() > max_loaded) {
+        Shard& shard = shards[lru.back()];
+        // Anyone still using the index keeps it alive.
+        shard.index.reset();
+        lru.pop_back();
+        shard.lru_position = lru.end();
+    }
+}
+
+size_t ShardedXG::shard_for_id(int64_t id) const {
+    // Find the last shard starting at or before the ID
+    auto found = std::upper_bound(shards_by_id.begin(), shards_by_id.end(), id,
+                                  [&](int64_t id, size_t number) { return id < shards[number].min_id; });
+    if (found == shards_by_id.begin() || shards[*(found - 1)].max_id < id) {
+        return numeric_limits<size_t>::max();
+    }
+    return *(found - 1);
+}
+
+size_t ShardedXG::shard_for_path(const string& name) const {
+    auto found = path_shards.find(name);
+    if (found == path_shards.end()) {
+        return numeric_limits<size_t>::max();
+    }
+    return found->second;
+}
+
+shared_ptr<const XG> ShardedXG::index_for_id(int64_t id) const {
+    size_t number = shard_for_id(id);
+    if (number == numeric_limits<size_t>::max()) return nullptr;
+    shared_ptr<const XG> index = get(number);
+    // Shards can have gaps in their ID ranges
+    return index->id_to_rank(id) != 0 ? index : nullptr;
+}
+
+shared_ptr<const XG> ShardedXG::index_for_path(const string& name) const {
+    size_t number = shard_for_path(name);
+    if (number == numeric_limits<size_t>::max()) return nullptr;
+    return get(number);
+}
+
+bool ShardedXG::has_node(int64_t id) const {
+    return index_for_id(id) != nullptr;
+}
+
+Node ShardedXG::node(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->node(id) : Node();
+}
+
+string ShardedXG::node_sequence(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->node_sequence(id) : "";
+}
+
+size_t ShardedXG::node_length(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->node_length(id) : 0;
+}
+
+char ShardedXG::pos_char(int64_t id, bool is_rev, size_t off) const {
+    auto index = index_for_id(id);
+    return index ? index->pos_char(id, is_rev, off) : '\0';
+}
+
+string ShardedXG::pos_substr(int64_t id, bool is_rev, size_t off, size_t len) const {
+    auto index = index_for_id(id);
+    return index ? index->pos_substr(id, is_rev, off, len) : "";
+}
+
+vector<Edge> ShardedXG::edges_of(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->edges_of(id) : vector<Edge>();
+}
+
+vector<Edge> ShardedXG::edges_to(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->edges_to(id) : vector<Edge>();
+}
+
+vector<Edge> ShardedXG::edges_from(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->edges_from(id) : vector<Edge>();
+}
+
+vector<Edge> ShardedXG::edges_on_start(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->edges_on_start(id) : vector<Edge>();
+}
+
+vector<Edge> ShardedXG::edges_on_end(int64_t id) const {
+    auto index = index_for_id(id);
+    return index ? index->edges_on_end(id) : vector<Edge>();
+}
+
+bool ShardedXG::has_edge(const Edge& edge) const {
+    // Edges never cross shards
+    size_t number = shard_for_id(edge.from());
+    if (number == numeric_limits<size_t>::max() || number != shard_for_id(edge.to())) return false;
+    shared_ptr<const XG> index = get(number);
+    return index->id_to_rank(edge.from()) != 0 && index->id_to_rank(edge.to()) != 0
+        && index->has_edge(edge);
+}
+
+bool ShardedXG::has_path(const string& name) const {
+    return shard_for_path(name) != numeric_limits<size_t>::max();
+}
+
+Path ShardedXG::path(const string& name) const {
+    auto index = index_for_path(name);
+    return index ? index->path(name) : Path();
+}
+
+size_t ShardedXG::path_rank(const string& name) const {
+    size_t number = shard_for_path(name);
+    if (number == numeric_limits<size_t>::max()) return 0;
+    return shards[number].path_rank_offset + get(number)->path_rank(name);
+}
+
+size_t ShardedXG::max_path_rank(void) const {
+    return path_count;
+}
+
+string ShardedXG::path_name(size_t rank) const {
+    for (size_t number = 0; number < shards.size(); ++number) {
+        const Shard& shard = shards[number];
+        if (rank > shard.path_rank_offset && rank <= shard.path_rank_offset + shard.path_count) {
+            return get(number)->path_name(rank - shard.path_rank_offset);
+        }
+    }
+    return "";
+}
+
+size_t ShardedXG::path_length(const string& name) const {
+    auto index = index_for_path(name);
+    return index ? index->path_length(name) : 0;
+}
+
+void ShardedXG::neighborhood(int64_t id, size_t dist, Graph& g, bool use_steps) const {
+    auto index = index_for_id(id);
+    if (index) index->neighborhood(id, dist, g, use_steps);
+}
+
+void ShardedXG::get_path_range(const string& name, int64_t start, int64_t stop, Graph& g, bool is_rev) const {
+    auto index = index_for_path(name);
+    if (index) index->get_path_range(name, start, stop, g, is_rev);
+}
+
+void ShardedXG::expand_context(Graph& g, size_t dist, bool add_paths, bool use_steps,
+                               bool expand_forward, bool expand_backward,
+                               int64_t until_node) const {
+    // Split the graph up by shard
+    map<size_t, Graph> parts;
+    for (int i = 0; i < g.node_size(); ++i) {
+        size_t number = shard_for_id(g.node(i).id());
+        if (number == numeric_limits<size_t>::max()) continue;
+        *parts[number].add_node() = g.node(i);
+    }
+    for (int i = 0; i < g.edge_size(); ++i) {
+        size_t number = shard_for_id(g.edge(i).from());
+        if (number == numeric_limits<size_t>::max()) continue;
+        *parts[number].add_edge() = g.edge(i);
+    }
+    for (int i = 0; i < g.path_size(); ++i) {
+        const Path& p = g.path(i);
+        if (p.mapping_size() == 0) continue;
+        size_t number = shard_for_id(p.mapping(0).position().node_id());
+        if (number == numeric_limits<size_t>::max()) continue;
+        *parts[number].add_path() = p;
+    }
+
+    // Expand each part in its shard, and put them back together
+    Graph expanded;
+    for (auto& part : parts) {
+        get(part.first)->expand_context(part.second, dist, add_paths, use_steps,
+                                        expand_forward, expand_backward, until_node);
+        expanded.MergeFrom(part.second);
+    }
+    g.Swap(&expanded);
+}
+
+void ShardedXG::get_id_range(int64_t id1, int64_t id2, Graph& g) const {
+    for (auto number : shards_by_id) {
+        const Shard& shard = shards[number];
+        if (shard.max_id < id1 || shard.min_id > id2) continue;
+        get(number)->get_id_range(max(id1, shard.min_id), min(id2, shard.max_id), g);
+    }
+}
+
+}
@@ -0,0 +1,139 @@
+#ifndef SHARDED_XG_HPP
+#define SHARDED_XG_HPP
+
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "xg.hpp"
+
+namespace xg {
+
+using namespace std;
+using namespace vg;
+
+/**
+ * Answers graph queries over several XG indexes ("shards") with disjoint node
+ * ID ranges, such as one index per chromosome. Each call is routed to the
+ * shard holding its node ID or path name.
+ *
+ * Shards are loaded from their files the first time a query needs them. When
+ * more than max_loaded shards are resident, the least recently used ones are
+ * unloaded, to be loaded again when next needed. A shard is loaded without
+ * holding up queries to other shards, and queries that need it while it is
+ * loading wait for that load instead of starting another.
+ *
+ * Adding shards is setup: add them all before making any queries, from one
+ * thread. After that, queries may come from several threads at once; a shard
+ * that is unloaded while a query is using it stays alive until that query
+ * finishes.
+ *
+ * Nodes that no shard holds have no sequence and no edges. Path ranks are
+ * global: the paths of each shard are numbered after those of the shards
+ * added before it.
+ */
+class ShardedXG {
+public:
+    // Keep at most max_loaded shards in memory at once; 0 means no limit.
+    ShardedXG(size_t max_loaded = 0);
+    ~ShardedXG(void);
+
+    ShardedXG(const ShardedXG& other) = delete;
+    ShardedXG(ShardedXG&& other) = delete;
+    ShardedXG& operator=(const ShardedXG& other) = delete;
+    ShardedXG& operator=(ShardedXG&& other) = delete;
+
+    // Add the shard serialized in the given file. It is loaded once to learn
+    // its node ID range and path names, and stays loaded until evicted.
+    // Shards must all be added before any queries are made. Throws an
+    // XGFormatError if the file is not a valid XG file; so does any query
+    // that has to load a shard again after it was evicted.
+    void add_shard(const string& filename);
+    // Add a shard whose node ID range and path names are already known,
+    // without loading it.
+    void add_shard(const string& filename, int64_t min_id, int64_t max_id,
+                   const vector<string>& path_names);
+
+    size_t shard_count(void) const;
+    size_t loaded_shard_count(void) const;
+    // Unload every shard. They are loaded again when next needed.
+    void unload_all(void);
+
+    bool has_node(int64_t id) const;
+    Node node(int64_t id) const;
+    string node_sequence(int64_t id) const;
+    size_t node_length(int64_t id) const;
+    char pos_char(int64_t id, bool is_rev, size_t off) const;
+    string pos_substr(int64_t id, bool is_rev, size_t off, size_t len = 0) const;
+    vector<Edge> edges_of(int64_t id) const;
+    vector<Edge> edges_to(int64_t id) const;
+    vector<Edge> edges_from(int64_t id) const;
+    vector<Edge> edges_on_start(int64_t id) const;
+    vector<Edge> edges_on_end(int64_t id) const;
+    bool has_edge(const Edge& edge) const;
+
+    bool has_path(const string& name) const;
+    Path path(const string& name) const;
+    // Returns 0 if there is no such path.
+    size_t path_rank(const string& name) const;
+    size_t max_path_rank(void) const;
+    string path_name(size_t rank) const;
+    size_t path_length(const string& name) const;
+
+    void neighborhood(int64_t id, size_t dist, Graph& g, bool use_steps = true) const;
+    void get_path_range(const string& name, int64_t start, int64_t stop, Graph& g, bool is_rev = false) const;
+    // Each shard expands the part of the graph that lies in it. Paths already
+    // in g stay with the shard holding their first node.
+    void expand_context(Graph& g, size_t dist, bool add_paths = true, bool use_steps = true,
+                        bool expand_forward = true, bool expand_backward = true,
+                        int64_t until_node = 0) const;
+    void get_id_range(int64_t id1, int64_t id2, Graph& g) const;
+
+private:
+
+    struct Shard {
+        string filename;
+        int64_t min_id;
+        int64_t max_id;
+        // Global ranks of this shard's paths start after this one.
+        size_t path_rank_offset;
+        size_t path_count;
+        // Null when the shard is not loaded.
+        shared_ptr<const XG> index;
+        // Valid while some query is loading the shard.
+        shared_future<shared_ptr<const XG>> loading;
+        // Where the shard is in the LRU list, if loaded.
+        list<size_t>::iterator lru_position;
+    };
+
+    // Get the index for a shard, loading it if needed.
+    shared_ptr<const XG> get(size_t shard) const;
+    // Get the index holding a node ID or path, or null if there is none.
+    shared_ptr<const XG> index_for_id(int64_t id) const;
+    shared_ptr<const XG> index_for_path(const string& name) const;
+    // Get the number of the shard holding a node ID or path, or
+    // numeric_limits<size_t>::max() if there is none. These read the shard
+    // tables without the lock, since they only change during setup.
+    size_t shard_for_id(int64_t id) const;
+    size_t shard_for_path(const string& name) const;
+    // Register a shard. Must be called with the lock held.
+    void register_shard(const string& filename, int64_t min_id, int64_t max_id,
+                        const vector<string>& path_names);
+    // Unload least recently used shards until at most max_loaded are loaded.
+    // Must be called with the lock held.
+    void evict(void) const;
+
+    size_t max_loaded;
+    mutable vector<Shard> shards;
+    // Shard numbers in node ID order
+    vector<size_t> shards_by_id;
+    map<string, size_t> path_shards;
+    size_t path_count = 0;
+    // Loaded shards, most recently used first
+    mutable list<size_t> lru;
+    mutable mutex shards_mutex;
+};
+
+}
+
+#endif
@@ -1,8 +1,18 @@
 #include "xg.hpp"
-#include "stream.hpp"
 
+#include <array>
 #include <bitset>
+#include <cstring>
+#include <tuple>
+#include <random>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/io/gzip_stream.h>
 
 //#define VERBOSE_DEBUG
 //#define debug_algorithms
@@ -69,6 +79,7 @@ char revdna3bit(int i) {
 
 const XG::destination_t XG::BS_SEPARATOR = 1;
 const XG::destination_t XG::BS_NULL = 0;
+const char XG::SEQUENCE_DELIMITER = '$';
 
 XG::XG(istream& in)
     : start_marker('#'),
@@ -106,6 +117,54 @@ XG::~XG(void) {
         delete paths.back();
         paths.pop_back();
     }
+    if (mapped_file != nullptr) {
+        munmap((void*) mapped_file, mapped_size);
+    }
+}
+
+// Reads from a block of memory, such as a memory-mapped file, without copying
+// it into a buffer of its own.
+class MemoryStreambuf : public std::streambuf {
+public:
+    MemoryStreambuf(const char* data, size_t size) {
+        char* start = const_cast<char*>(data);
+        setg(start, start, start + size);
+    }
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+        char* target = (dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr()) + off;
+        if (!(which & std::ios_base::in) || target < eback() || target > egptr()) return pos_type(off_type(-1));
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+static size_t align_section(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// A fast checksum for sections, taking 8 bytes at a time and mixing each in
+// with a multiply.
+static uint64_t section_checksum(const char* data, size_t size) {
+    const uint64_t multiplier = 0xff51afd7ed558ccdULL;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, size - i);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    return hash;
 }
 
 void XG::load(istream& in) {
@@ -153,13 +212,17 @@ void XG::load(istream& in) {
         // DO NOT CHANGE THIS CODE without creating a new XG version:
         // 1. Increment OUTPUT_VERSION to a new integer.
         // 2. Change the serialization code.
-        // 3. Add a new case here with new deserialization code.
+        // 3. Add a case here for it, reading anything new only when
+        //    file_version is at least your new version.
         // 4. Up MAX_INPUT_VERSION to allow your new version to be read.
         ////////////////////////////////////////////////////////////////////////
         switch (file_version) {
         
         case 0:
         case 1:
+        case 2:
+        case 3:
+        case 4:
             {
                 sdsl::read_member(seq_length, in);
                 sdsl::read_member(node_count, in);
@@ -172,8 +235,18 @@ void XG::load(istream& in) {
 
                 i_iv.load(in);
                 r_iv.load(in);
+                if (file_version >= 2) {
+                    // Version 2 can use a sparse ID to rank mapping instead
+                    r_sdv.load(in);
+                }
+                util::assign(r_sdv_rank, sd_vector<>::rank_1_type(&r_sdv));
+                sparse_ids = r_sdv.size() > 0;
 
-                s_iv.load(in);
+                {
+                    int_vector<> bases_3bit;
+                    bases_3bit.load(in);
+                    pack_sequence(bases_3bit);
+                }
                 s_cbv.load(in);
                 s_cbv_rank.load(in, &s_cbv);
                 s_cbv_select.load(in, &s_cbv);
@@ -192,7 +265,20 @@ void XG::load(istream& in) {
                 t_to_end_cbv.load(in);
                 t_from_start_cbv.load(in);
 
-                tn_csa.load(in);
+                if (file_version >= 4) {
+                    tn_csa.load(in);
+                } else {
+                    // Older files store the thread names in an uncompressed
+                    // suffix array. Pull the text out and index it again.
+                    csa_bitcompressed<> old_tn_csa;
+                    old_tn_csa.load(in);
+                    string old_names;
+                    if (old_tn_csa.size() > 1) {
+                        old_names = extract(old_tn_csa, 0, old_tn_csa.size() - 2);
+                    }
+                    util::clear(old_tn_csa);
+                    construct_im(tn_csa, old_names, 1);
+                }
                 tn_cbv.load(in);
                 tn_cbv_rank.load(in, &tn_cbv);
                 tn_cbv_select.load(in, &tn_cbv);
@@ -222,12 +308,42 @@ void XG::load(istream& in) {
 
                 // Load all the B_s arrays for sides.
                 // Baking required before serialization.
+#if GPBWT_MODE == MODE_SDSL
+                if (file_version >= 3) {
+                    deserialize(bs_single_array, in);
+                } else {
+                    // Older files store B_s over bytes. Convert it to our
+                    // integer alphabet.
+                    byte_rank_select_int_vector byte_bs;
+                    byte_bs.load(in);
+                    int_vector<> all_bs_arrays(byte_bs.size());
+                    for (size_t i = 0; i < byte_bs.size(); i++) {
+                        all_bs_arrays[i] = byte_bs[i];
+                    }
+                    util::clear(byte_bs);
+                    util::bit_compress(all_bs_arrays);
+                    construct_im(bs_single_array, all_bs_arrays, 0);
+                }
+#elif GPBWT_MODE == MODE_DYNAMIC
                 deserialize(bs_single_array, in);
+#endif
             }
             break;
+        case 5:
+        case 6:
+        case 7:
+        case 8:
+        case 9:
+            // Version 6 adds checksums, version 7 packs the sequence,
+            // version 8 can index it, and version 9 groups edges by side
+            load_sections(in, file_version);
+            break;
         default:
             throw XGFormatError("Unimplemented XG format version: " + to_string(file_version));
         }
+        if (dense_node_starts) {
+            index_node_starts();
+        }
     } catch (const XGFormatError& e) {
         // Pass XGFormatErrors through
         throw e;
@@ -242,6 +358,436 @@ void XG::load(istream& in) {
 
 }
 
+void XG::load_sections(istream& in, uint32_t file_version) {
+    // The header is padded out to the alignment
+    size_t position = 2 + sizeof(uint32_t);
+    in.ignore(SECTION_ALIGNMENT - position);
+    position = SECTION_ALIGNMENT;
+
+    uint64_t section_count = 0;
+    sdsl::read_member(section_count, in);
+    position += sizeof(section_count);
+    if (!in || section_count < FIRST_PATH_SECTION) {
+        throw XGFormatError("XG table of contents is truncated");
+    }
+    vector<SectionEntry> toc(section_count);
+    in.read((char*) toc.data(), section_count * sizeof(SectionEntry));
+    position += section_count * sizeof(SectionEntry);
+    if (!in) {
+        throw XGFormatError("XG table of contents is truncated");
+    }
+    // Each section is followed by its checksum from version 6 on.
+    size_t checksum_size = file_version >= 6 ? sizeof(uint64_t) : 0;
+    if (file_version >= 6) {
+        uint64_t toc_checksum = 0;
+        sdsl::read_member(toc_checksum, in);
+        position += sizeof(toc_checksum);
+        if (!in || toc_checksum != toc_checksum_of(section_count, toc)) {
+            throw XGFormatError("XG table of contents is corrupt");
+        }
+    }
+
+    paths.resize(section_count - FIRST_PATH_SECTION, nullptr);
+    // Read the sections into memory a batch at a time, and parse each batch
+    // in parallel. A section bigger than a batch gets a batch of its own.
+    const size_t batch_bytes = 256 * 1024 * 1024;
+    size_t i = 0;
+    while (i < section_count) {
+        vector<size_t> batch;
+        vector<string> blocks;
+        size_t bytes = 0;
+        while (i < section_count && (batch.empty() || bytes + toc[i].size <= batch_bytes)) {
+            // Sections are written in order, so we only ever skip padding.
+            if (toc[i].offset < position) {
+                throw XGFormatError("XG section " + to_string(i) + " overlaps the one before it");
+            }
+            in.ignore(toc[i].offset - position);
+            string block(toc[i].size + checksum_size, '\0');
+            in.read(&block[0], block.size());
+            if (!in) {
+                throw XGFormatError("XG section " + to_string(i) + " is truncated");
+            }
+            position = toc[i].offset + block.size();
+            bytes += toc[i].size;
+            batch.push_back(i);
+            blocks.push_back(std::move(block));
+            ++i;
+        }
+        vector<const char*> starts;
+        vector<size_t> sizes;
+        for (auto& block : blocks) {
+            starts.push_back(block.data());
+            sizes.push_back(block.size() - checksum_size);
+        }
+        load_sections_parallel(batch, starts, sizes, file_version);
+    }
+}
+
+void XG::load(const string& filename, int eager_sections) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw XGFormatError("Index file does not exist or index stream cannot be read");
+    }
+    struct stat file_stats;
+    if (fstat(fd, &file_stats) == -1) {
+        close(fd);
+        throw XGFormatError("Index file " + filename + " cannot be read");
+    }
+    size_t size = file_stats.st_size;
+    if (size == 0) {
+        close(fd);
+        // Let the stream loader complain about the empty file
+        stringstream empty;
+        load(empty);
+        return;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw XGFormatError("Index file " + filename + " cannot be mapped");
+    }
+    const char* data = (const char*) mapping;
+
+    uint32_t file_version = 0;
+    if (size >= SECTION_ALIGNMENT && data[0] == 'X' && data[1] == 'G') {
+        memcpy(&file_version, data + 2, sizeof(file_version));
+        file_version = ntohl(file_version);
+    }
+    if (file_version < 5 || file_version > MAX_INPUT_VERSION) {
+        // Parse straight out of the page cache. The SDSL structures still
+        // copy what they read, since they own their memory.
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        MemoryStreambuf buffer(data, size);
+        istream in(&buffer);
+        try {
+            load(in);
+        } catch (...) {
+            munmap(mapping, size);
+            throw;
+        }
+        munmap(mapping, size);
+        return;
+    }
+
+    try {
+        read_table_of_contents(data, size, file_version, mapped_toc);
+    } catch (...) {
+        munmap(mapping, size);
+        throw;
+    }
+    mapped_version = file_version;
+    mapped_file = data;
+    mapped_size = size;
+    paths.resize(mapped_toc.size() - FIRST_PATH_SECTION, nullptr);
+
+    vector<size_t> sections = {META_SECTION, SEQUENCE_SECTION, EDGES_SECTION};
+    if (eager_sections & LOAD_PATHS) {
+        auto more = path_sections();
+        sections.insert(sections.end(), more.begin(), more.end());
+    } else {
+        paths_pending = true;
+    }
+    if (eager_sections & LOAD_THREADS) {
+        auto more = thread_sections();
+        sections.insert(sections.end(), more.begin(), more.end());
+    } else {
+        threads_pending = true;
+    }
+    {
+        lock_guard<mutex> guard(mapping_mutex);
+        load_mapped_sections(sections);
+        release_mapping();
+    }
+    if (dense_node_starts) {
+        index_node_starts();
+    }
+}
+
+vector<size_t> XG::path_sections(void) const {
+    vector<size_t> sections = {PATH_NAMES_SECTION, ENTITY_PATHS_SECTION};
+    for (size_t i = FIRST_PATH_SECTION; i < FIRST_PATH_SECTION + paths.size(); ++i) {
+        sections.push_back(i);
+    }
+    return sections;
+}
+
+vector<size_t> XG::thread_sections(void) const {
+    return {THREAD_NAMES_SECTION, GPBWT_SECTION};
+}
+
+void XG::load_mapped_sections(const vector<size_t>& sections) {
+    vector<const char*> starts;
+    vector<size_t> sizes;
+    for (auto section : sections) {
+        const SectionEntry& entry = mapped_toc.at(section);
+        starts.push_back(mapped_file + entry.offset);
+        sizes.push_back(entry.size);
+    }
+    load_sections_parallel(sections, starts, sizes, mapped_version);
+}
+
+void XG::load_sections_parallel(const vector<size_t>& sections,
+                                const vector<const char*>& starts,
+                                const vector<size_t>& sizes,
+                                uint32_t file_version) {
+    // Start the biggest sections first, so the small ones fill in around them.
+    vector<size_t> order(sections.size());
+    for (size_t k = 0; k < order.size(); ++k) order[k] = k;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    // Each section fills in its own members, so they can all load at once.
+    // Errors can't leave the parallel loop, so we hold on to them.
+    vector<exception_ptr> failures(sections.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t k = 0; k < order.size(); ++k) {
+        size_t j = order[k];
+        try {
+            if (file_version >= 6) {
+                uint64_t expected;
+                memcpy(&expected, starts[j] + sizes[j], sizeof(expected));
+                if (section_checksum(starts[j], sizes[j]) != expected) {
+                    throw XGFormatError("XG section " + to_string(sections[j]) + " fails its checksum");
+                }
+            }
+            MemoryStreambuf buffer(starts[j], sizes[j]);
+            istream in(&buffer);
+            load_section(sections[j], in, file_version);
+            if (!in) {
+                throw XGFormatError("XG section " + to_string(sections[j]) + " is truncated");
+            }
+        } catch (const bad_alloc& e) {
+            failures[j] = make_exception_ptr(XGFormatError("XG section " + to_string(sections[j]) +
+                                                           " is corrupt (" + e.what() + ")"));
+        } catch (...) {
+            failures[j] = current_exception();
+        }
+    }
+    for (auto& failure : failures) {
+        if (failure) rethrow_exception(failure);
+    }
+}
+
+void XG::ensure_paths(void) const {
+    call_once(paths_loaded, [&]() {
+        XG& self = const_cast<XG&>(*this);
+        // The threads may be loading from the same mapping at the same time.
+        lock_guard<mutex> guard(mapping_mutex);
+        if (!paths_pending) return;
+        self.load_mapped_sections(path_sections());
+        self.paths_pending = false;
+        self.release_mapping();
+    });
+}
+
+void XG::ensure_threads(void) const {
+    call_once(threads_loaded, [&]() {
+        XG& self = const_cast<XG&>(*this);
+        lock_guard<mutex> guard(mapping_mutex);
+        if (!threads_pending) return;
+        self.load_mapped_sections(thread_sections());
+        self.threads_pending = false;
+        self.release_mapping();
+    });
+}
+
+void XG::release_mapping(void) {
+    if (mapped_file != nullptr && !paths_pending && !threads_pending) {
+        munmap((void*) mapped_file, mapped_size);
+        mapped_file = nullptr;
+        mapped_size = 0;
+        mapped_toc.clear();
+    }
+}
+
+uint64_t XG::toc_checksum_of(uint64_t section_count, const vector<SectionEntry>& toc) {
+    string bytes((const char*) &section_count, sizeof(section_count));
+    bytes.append((const char*) toc.data(), toc.size() * sizeof(SectionEntry));
+    return section_checksum(bytes.data(), bytes.size());
+}
+
+void XG::read_table_of_contents(const char* data, size_t size, uint32_t file_version,
+                                vector<SectionEntry>& toc) {
+    // Find all the sections, and make sure they are really in the file.
+    uint64_t section_count = 0;
+    size_t toc_start = SECTION_ALIGNMENT + sizeof(section_count);
+    if (size >= toc_start) {
+        memcpy(&section_count, data + SECTION_ALIGNMENT, sizeof(section_count));
+    }
+    size_t checksum_size = file_version >= 6 ? sizeof(uint64_t) : 0;
+    if (size < toc_start + checksum_size || section_count < FIRST_PATH_SECTION
+        || section_count > (size - toc_start - checksum_size) / sizeof(SectionEntry)) {
+        throw XGFormatError("XG table of contents is truncated");
+    }
+    toc.resize(section_count);
+    memcpy(toc.data(), data + toc_start, section_count * sizeof(SectionEntry));
+    if (file_version >= 6) {
+        uint64_t toc_checksum;
+        memcpy(&toc_checksum, data + toc_start + section_count * sizeof(SectionEntry), sizeof(toc_checksum));
+        if (toc_checksum != toc_checksum_of(section_count, toc)) {
+            toc.clear();
+            throw XGFormatError("XG table of contents is corrupt");
+        }
+    }
+    for (size_t i = 0; i < section_count; ++i) {
+        if (toc[i].offset > size || toc[i].size + checksum_size > size - toc[i].offset) {
+            toc.clear();
+            throw XGFormatError("XG section " + to_string(i) + " is truncated");
+        }
+    }
+}
+
+bool XG::verify_file(const string& filename, ostream& report) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat file_stats;
+    if (fd == -1 || fstat(fd, &file_stats) == -1 || file_stats.st_size == 0) {
+        if (fd != -1) close(fd);
+        report << filename << ": cannot be read" << endl;
+        return false;
+    }
+    size_t size = file_stats.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        report << filename << ": cannot be mapped" << endl;
+        return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    const char* data = (const char*) mapping;
+
+    uint32_t file_version = 0;
+    if (size >= SECTION_ALIGNMENT && data[0] == 'X' && data[1] == 'G') {
+        memcpy(&file_version, data + 2, sizeof(file_version));
+        file_version = ntohl(file_version);
+    }
+    bool ok = true;
+    vector<SectionEntry> toc;
+    if (file_version < 6 || file_version > MAX_INPUT_VERSION) {
+        report << filename << ": version " << file_version << " files have no checksums" << endl;
+        ok = false;
+    } else {
+        try {
+            read_table_of_contents(data, size, file_version, toc);
+        } catch (const XGFormatError& e) {
+            report << filename << ": " << e.what() << endl;
+            ok = false;
+        }
+    }
+
+    // Only the checksums are computed, so this goes as fast as we can read.
+    vector<bool> bad(toc.size(), false);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < toc.size(); ++i) {
+        uint64_t expected;
+        memcpy(&expected, data + toc[i].offset + toc[i].size, sizeof(expected));
+        if (section_checksum(data + toc[i].offset, toc[i].size) != expected) {
+#pragma omp critical (verify_report)
+            bad[i] = true;
+        }
+    }
+    for (size_t i = 0; i < toc.size(); ++i) {
+        if (bad[i]) {
+            report << filename << ": section " << i << " fails its checksum" << endl;
+            ok = false;
+        }
+    }
+    munmap(mapping, size);
+    return ok;
+}
+
+void XG::load_section(size_t section, istream& in, uint32_t file_version) {
+    switch (section) {
+    case META_SECTION:
+        sdsl::read_member(seq_length, in);
+        sdsl::read_member(node_count, in);
+        sdsl::read_member(edge_count, in);
+        sdsl::read_member(path_count, in);
+        sdsl::read_member(min_id, in);
+        sdsl::read_member(max_id, in);
+        i_iv.load(in);
+        r_iv.load(in);
+        r_sdv.load(in);
+        util::assign(r_sdv_rank, sd_vector<>::rank_1_type(&r_sdv));
+        sparse_ids = r_sdv.size() > 0;
+        break;
+    case SEQUENCE_SECTION:
+        if (file_version >= 7) {
+            s_iv.load(in);
+            sn_sdv.load(in);
+            util::assign(sn_sdv_rank, sd_vector<>::rank_1_type(&sn_sdv));
+            util::assign(sn_sdv_select, sd_vector<>::select_1_type(&sn_sdv));
+        } else {
+            // Older files use 3 bits per base
+            int_vector<> bases_3bit;
+            bases_3bit.load(in);
+            pack_sequence(bases_3bit);
+        }
+        s_cbv.load(in);
+        s_cbv_rank.load(in, &s_cbv);
+        s_cbv_select.load(in, &s_cbv);
+        if (file_version >= 8) {
+            s_csa.load(in);
+            sl_sdv.load(in);
+            util::assign(sl_sdv_rank, sd_vector<>::rank_1_type(&sl_sdv));
+            util::assign(sl_sdv_select, sd_vector<>::select_1_type(&sl_sdv));
+        }
+        break;
+    case EDGES_SECTION:
+        f_iv.load(in);
+        f_bv.load(in);
+        f_bv_rank.load(in, &f_bv);
+        f_bv_select.load(in, &f_bv);
+        f_from_start_cbv.load(in);
+        f_to_end_cbv.load(in);
+        t_iv.load(in);
+        t_bv.load(in);
+        t_bv_rank.load(in, &t_bv);
+        t_bv_select.load(in, &t_bv);
+        t_to_end_cbv.load(in);
+        t_from_start_cbv.load(in);
+        if (file_version >= 9) {
+            sa_iv.load(in);
+            sa_offsets.load(in);
+        }
+        break;
+    case THREAD_NAMES_SECTION:
+        tn_csa.load(in);
+        tn_cbv.load(in);
+        tn_cbv_rank.load(in, &tn_cbv);
+        tn_cbv_select.load(in, &tn_cbv);
+        tin_civ.load(in);
+        tio_civ.load(in);
+        side_thread_wt.load(in);
+        break;
+    case PATH_NAMES_SECTION:
+        pn_iv.load(in);
+        pn_csa.load(in);
+        pn_bv.load(in);
+        pn_bv_rank.load(in, &pn_bv);
+        pn_bv_select.load(in, &pn_bv);
+        pi_iv.load(in);
+        break;
+    case ENTITY_PATHS_SECTION:
+        ep_iv.load(in);
+        ep_bv.load(in);
+        ep_bv_rank.load(in, &ep_bv);
+        ep_bv_select.load(in, &ep_bv);
+        break;
+    case GPBWT_SECTION:
+        h_iv.load(in);
+        ts_iv.load(in);
+        deserialize(bs_single_array, in);
+        break;
+    default:
+        {
+            // Each path has its own section. The vector is already sized.
+            auto path = new XGPath;
+            path->load(in);
+            paths.at(section - FIRST_PATH_SECTION) = path;
+        }
+        break;
+    }
+}
+
 void XGPath::load(istream& in) {
     members.load(in);
     members_rank.load(in, &members);
@@ -372,151 +918,981 @@ XGPath::XGPath(const string& path_name,
             }
         }
     }
-    //cerr << uniq_nodes.size() << " vs " << path.size() << endl;
-    if(unique_member_count_out) {
-        // set member count as the unique entities that are in the path
-        // We don't need it but our caller might
-        *unique_member_count_out = uniq_nodes.size() + uniq_edges.size();
-    }
-    // compress path membership vectors
-    util::assign(members, rrr_vector<>(members_bv));
-    util::assign(members_rank, rrr_vector<>::rank_1_type(&members));
-    util::assign(members_select, rrr_vector<>::select_1_type(&members));
-    // and traversal information
-    util::assign(directions, sd_vector<>(directions_bv));
-    // handle entity lookup structure (wavelet tree)
-    util::bit_compress(ids_iv);
-    construct_im(ids, ids_iv);
-    // bit compress the positional offset info
-    util::bit_compress(positions);
-    // bit compress mapping ranks
-    util::bit_compress(ranks);
+    //cerr << uniq_nodes.size() << " vs " << path.size() << endl;
+    if(unique_member_count_out) {
+        // set member count as the unique entities that are in the path
+        // We don't need it but our caller might
+        *unique_member_count_out = uniq_nodes.size() + uniq_edges.size();
+    }
+    // compress path membership vectors
+    util::assign(members, rrr_vector<>(members_bv));
+    util::assign(members_rank, rrr_vector<>::rank_1_type(&members));
+    util::assign(members_select, rrr_vector<>::select_1_type(&members));
+    // and traversal information
+    util::assign(directions, sd_vector<>(directions_bv));
+    // handle entity lookup structure (wavelet tree)
+    util::bit_compress(ids_iv);
+    // SDSL names the temporary files construct_im uses with a counter that
+    // isn't thread safe, so paths being built in parallel take turns here.
+#pragma omp critical (construct_im)
+    construct_im(ids, ids_iv);
+    // bit compress the positional offset info
+    util::bit_compress(positions);
+    // bit compress mapping ranks
+    util::bit_compress(ranks);
+
+    // and set up rank/select dictionary on them
+    util::assign(offsets_rank, rank_support_v<1>(&offsets));
+    util::assign(offsets_select, bit_vector::select_1_type(&offsets));
+}
+
+Mapping XGPath::mapping(size_t offset) const {
+    // TODO actually store the "real" mapping
+    Mapping m;
+    // store the starting position and series of edits
+    m.mutable_position()->set_node_id(ids[offset]);
+    m.mutable_position()->set_is_reverse(directions[offset]);
+    m.set_rank(ranks[offset]);
+    return m;
+}
+
+size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) {
+
+    ensure_paths();
+    ensure_threads();
+
+    sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
+    size_t written = 0;
+    // Where we started, if the stream can tell us, so we can come back.
+    std::streampos start = out.tellp();
+    bool seekable = start != std::streampos(-1);
+    
+    // Do the magic number
+    out << "XG";
+    written += 2;
+    
+    // And the version number
+    int32_t version_buffer = htonl(OUTPUT_VERSION);
+    out.write((char*) &version_buffer, sizeof(version_buffer));
+    written += sizeof(version_buffer) / sizeof(char);
+    
+    ////////////////////////////////////////////////////////////////////////
+    // DO NOT CHANGE THIS CODE without creating a new XG version:
+    // 1. Increment OUTPUT_VERSION to a new integer.
+    // 2. Add your new serialization code.
+    // 3. Add a case for your new version to XG::load()
+    // 4. Up MAX_INPUT_VERSION to allow your new version to be read.
+    ////////////////////////////////////////////////////////////////////////
+
+    // Pad the header out to the alignment
+    const char padding[SECTION_ALIGNMENT] = {0};
+    out.write(padding, SECTION_ALIGNMENT - written);
+    written = SECTION_ALIGNMENT;
+
+    // The table of contents comes first, but we only learn how big each
+    // section is by encoding it. If the stream can seek, we leave room for
+    // the table and come back to fill it in. Otherwise every section has to
+    // be encoded, and held, before any of them is written.
+    uint64_t section_count = FIRST_PATH_SECTION + paths.size();
+    vector<SectionEntry> toc(section_count);
+    size_t toc_bytes = sizeof(section_count) + section_count * sizeof(SectionEntry) + sizeof(uint64_t);
+    auto write_toc = [&](void) {
+        sdsl::write_member(section_count, out);
+        out.write((const char*) toc.data(), section_count * sizeof(SectionEntry));
+        sdsl::write_member(toc_checksum_of(section_count, toc), out);
+    };
+    sdsl::structure_tree::add_size(sdsl::structure_tree::add_child(child, "section_count", "uint64_t"),
+                                   sizeof(section_count));
+    sdsl::structure_tree::add_size(sdsl::structure_tree::add_child(child, "table_of_contents", "SectionEntry"),
+                                   section_count * sizeof(SectionEntry));
+    sdsl::structure_tree::add_size(sdsl::structure_tree::add_child(child, "table_of_contents_checksum", "uint64_t"),
+                                   sizeof(uint64_t));
+    if (seekable) {
+        out.write(string(toc_bytes, '\0').data(), toc_bytes);
+    }
+    written += toc_bytes;
+
+    // Treat the paths and threads as their own nodes.
+    // This will mess up any sort of average size stats, but it will also be useful.
+    auto paths_child = sdsl::structure_tree::add_child(child, "paths", sdsl::util::class_name(*this));
+    auto threads_child = sdsl::structure_tree::add_child(child, "threads", sdsl::util::class_name(*this));
+    auto checksums_child = sdsl::structure_tree::add_child(child, "section_checksums", "uint64_t");
+    size_t paths_written = 0;
+    size_t threads_written = 0;
+    auto parent_of = [&](size_t i) {
+        return i == GPBWT_SECTION ? threads_child : i >= PATH_NAMES_SECTION ? paths_child : child;
+    };
+
+    // Encode a batch of sections into memory in parallel, and lay them out
+    // in order. We write each batch as soon as it is done if we can.
+    vector<string> blocks(section_count);
+    vector<uint64_t> checksums(section_count);
+    size_t offset = align_section(written, SECTION_ALIGNMENT);
+    auto write_section = [&](size_t j) {
+        out.write(padding, toc[j].offset - written);
+        out.write(blocks[j].data(), blocks[j].size());
+        out.write((const char*) &checksums[j], sizeof(checksums[j]));
+        written = toc[j].offset + toc[j].size + sizeof(uint64_t);
+        string().swap(blocks[j]);
+    };
+    size_t batch_size = omp_get_max_threads();
+    for (size_t i = 0; i < section_count; i += batch_size) {
+        size_t batch_end = min(i + batch_size, (size_t) section_count);
+        // The structure tree can only be built up from one thread.
+#pragma omp parallel for schedule(dynamic, 1) if(child == nullptr)
+        for (size_t j = i; j < batch_end; ++j) {
+            stringstream block;
+            serialize_section(j, block, parent_of(j));
+            blocks[j] = block.str();
+            checksums[j] = section_checksum(blocks[j].data(), blocks[j].size());
+        }
+        for (size_t j = i; j < batch_end; ++j) {
+            // Every section, and the table of contents, is followed by its checksum.
+            toc[j].size = blocks[j].size();
+            toc[j].offset = offset;
+            offset = align_section(offset + toc[j].size + sizeof(uint64_t), SECTION_ALIGNMENT);
+            if (j == GPBWT_SECTION) {
+                threads_written += toc[j].size;
+            } else if (j >= PATH_NAMES_SECTION) {
+                paths_written += toc[j].size;
+            }
+            if (seekable) {
+                write_section(j);
+            }
+        }
+    }
+    if (seekable) {
+        std::streampos end = out.tellp();
+        out.seekp(start + std::streamoff(SECTION_ALIGNMENT));
+        write_toc();
+        out.seekp(end);
+    } else {
+        write_toc();
+        for (size_t j = 0; j < section_count; ++j) {
+            write_section(j);
+        }
+    }
+    sdsl::structure_tree::add_size(checksums_child, section_count * sizeof(uint64_t));
+    
+    sdsl::structure_tree::add_size(paths_child, paths_written);
+    sdsl::structure_tree::add_size(threads_child, threads_written);
+    sdsl::structure_tree::add_size(child, written);
+    return written;
+    
+}
+
+size_t XG::serialize_section(size_t section, ostream& out, sdsl::structure_tree_node* child) {
+    size_t written = 0;
+    switch (section) {
+    case META_SECTION:
+        written += sdsl::write_member(s_iv.size(), out, child, "sequence_length");
+        written += sdsl::write_member(i_iv.size(), out, child, "node_count");
+        written += sdsl::write_member(f_iv.size()-i_iv.size(), out, child, "edge_count");
+        written += sdsl::write_member(path_count, out, child, "path_count");
+        written += sdsl::write_member(min_id, out, child, "min_id");
+        written += sdsl::write_member(max_id, out, child, "max_id");
+        written += i_iv.serialize(out, child, "id_rank_vector");
+        written += r_iv.serialize(out, child, "rank_id_vector");
+        written += r_sdv.serialize(out, child, "rank_id_sparse_vector");
+        break;
+    case SEQUENCE_SECTION:
+        written += s_iv.serialize(out, child, "seq_vector");
+        written += sn_sdv.serialize(out, child, "seq_n_positions");
+        written += s_cbv.serialize(out, child, "seq_node_starts");
+        written += s_cbv_rank.serialize(out, child, "seq_node_starts_rank");
+        written += s_cbv_select.serialize(out, child, "seq_node_starts_select");
+        written += s_csa.serialize(out, child, "seq_csa");
+        written += sl_sdv.serialize(out, child, "seq_csa_node_starts");
+        break;
+    case EDGES_SECTION:
+        written += f_iv.serialize(out, child, "from_vector");
+        written += f_bv.serialize(out, child, "from_node");
+        written += f_bv_rank.serialize(out, child, "from_node_rank");
+        written += f_bv_select.serialize(out, child, "from_node_select");
+        written += f_from_start_cbv.serialize(out, child, "from_is_from_start");
+        written += f_to_end_cbv.serialize(out, child, "from_is_to_end");
+        written += t_iv.serialize(out, child, "to_vector");
+        written += t_bv.serialize(out, child, "to_node");
+        written += t_bv_rank.serialize(out, child, "to_node_rank");
+        written += t_bv_select.serialize(out, child, "to_node_select");
+        written += t_to_end_cbv.serialize(out, child, "to_is_to_end");
+        written += t_from_start_cbv.serialize(out, child, "to_is_from_start");
+        written += sa_iv.serialize(out, child, "side_adjacency");
+        written += sa_offsets.serialize(out, child, "side_adjacency_offsets");
+        break;
+    case THREAD_NAMES_SECTION:
+        // save the thread name index
+        written += tn_csa.serialize(out, child, "thread_name_csa");
+        written += tn_cbv.serialize(out, child, "thread_name_cbv");
+        written += tn_cbv_rank.serialize(out, child, "thread_name_cbv_rank");
+        written += tn_cbv_select.serialize(out, child, "thread_name_cbv_select");
+        written += tin_civ.serialize(out, child, "thread_start_node_civ");
+        written += tio_civ.serialize(out, child, "thread_start_offset_civ");
+        written += side_thread_wt.serialize(out, child, "side_thread_wt");
+        break;
+    case PATH_NAMES_SECTION:
+        written += pn_iv.serialize(out, child, "path_names");
+        written += pn_csa.serialize(out, child, "path_names_csa");
+        written += pn_bv.serialize(out, child, "path_names_starts");
+        written += pn_bv_rank.serialize(out, child, "path_names_starts_rank");
+        written += pn_bv_select.serialize(out, child, "path_names_starts_select");
+        written += pi_iv.serialize(out, child, "path_ids");
+        break;
+    case ENTITY_PATHS_SECTION:
+        written += ep_iv.serialize(out, child, "entity_path_mapping");
+        written += ep_bv.serialize(out, child, "entity_path_mapping_starts");
+        written += ep_bv_rank.serialize(out, child, "entity_path_mapping_starts_rank");
+        written += ep_bv_select.serialize(out, child, "entity_path_mapping_starts_select");
+        break;
+    case GPBWT_SECTION:
+        written += h_iv.serialize(out, child, "thread_usage_count");
+        written += ts_iv.serialize(out, child, "thread_start_count");
+        // Stick all the B_s arrays in together. Must be baked.
+        written += xg::serialize(bs_single_array, out, child, "bs_single_array");
+        break;
+    default:
+        {
+            size_t i = section - FIRST_PATH_SECTION;
+            written += paths.at(i)->serialize(out, child, "path:" + path_name(i + 1));
+        }
+        break;
+    }
+    return written;
+}
+
+bool XGBuildBuffer::EdgeOrder::operator()(const pair<side_t, side_t>& a, const pair<side_t, side_t>& b) const {
+    // Group by node, then by side (start before end), then by the other side,
+    // which is the order the edges take in f_iv and t_iv.
+    return make_tuple(side_id(a.first), side_is_end(a.first), a.second)
+        < make_tuple(side_id(b.first), side_is_end(b.first), b.second);
+}
+
+bool XGBuildBuffer::StepOrder::operator()(const pair<size_t, trav_t>& a, const pair<size_t, trav_t>& b) const {
+    return make_pair(a.first, trav_rank(a.second)) < make_pair(b.first, trav_rank(b.second));
+}
+
+// Binary record I/O for the sorted runs used in external construction.
+
+static void write_record(ostream& out, const pair<id_t, string>& node) {
+    uint64_t length = node.second.size();
+    out.write((const char*) &node.first, sizeof(node.first));
+    out.write((const char*) &length, sizeof(length));
+    out.write(node.second.data(), length);
+}
+
+static bool read_record(istream& in, pair<id_t, string>& node) {
+    uint64_t length;
+    if (!in.read((char*) &node.first, sizeof(node.first))) return false;
+    in.read((char*) &length, sizeof(length));
+    node.second.resize(length);
+    in.read(&node.second[0], length);
+    return (bool) in;
+}
+
+static void write_record(ostream& out, const pair<side_t, side_t>& edge) {
+    out.write((const char*) &edge.first, sizeof(edge.first));
+    out.write((const char*) &edge.second, sizeof(edge.second));
+}
+
+static bool read_record(istream& in, pair<side_t, side_t>& edge) {
+    in.read((char*) &edge.first, sizeof(edge.first));
+    in.read((char*) &edge.second, sizeof(edge.second));
+    return (bool) in;
+}
+
+static void write_record(ostream& out, const pair<size_t, trav_t>& step) {
+    uint64_t path = step.first;
+    out.write((const char*) &path, sizeof(path));
+    out.write((const char*) &step.second.first, sizeof(step.second.first));
+    out.write((const char*) &step.second.second, sizeof(step.second.second));
+}
+
+static bool read_record(istream& in, pair<size_t, trav_t>& step) {
+    uint64_t path;
+    in.read((char*) &path, sizeof(path));
+    in.read((char*) &step.second.first, sizeof(step.second.first));
+    in.read((char*) &step.second.second, sizeof(step.second.second));
+    step.first = path;
+    return (bool) in;
+}
+
+// Sort the records with a stable sort, so that equal records keep the order
+// they were added in, and write them to the given file as a run. Empties the
+// records.
+template<typename Record, typename Less>
+static void write_run(vector<Record>& records, const string& filename, Less less) {
+    std::stable_sort(records.begin(), records.end(), less);
+    ofstream out(filename, ios::binary);
+    for (auto& record : records) {
+        write_record(out, record);
+    }
+    if (!out) {
+        cerr << "[xg] error: could not write temporary file " << filename << endl;
+        exit(1);
+    }
+    records.clear();
+    records.shrink_to_fit();
+}
+
+// K-way merge the given sorted runs, calling the lambda on every record in
+// order. Equal records come out in run order, so the first one seen is the
+// one that was added first.
+template<typename Record, typename Less>
+static void merge_runs(const vector<string>& runs, Less less,
+                       const function<void(const Record&)>& lambda) {
+    typedef pair<Record, size_t> head_t;
+    auto later = [&less](const head_t& a, const head_t& b) {
+        return less(b.first, a.first) || (!less(a.first, b.first) && a.second > b.second);
+    };
+    priority_queue<head_t, vector<head_t>, decltype(later)> heads(later);
+    vector<unique_ptr<ifstream> > ins;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        ins.emplace_back(new ifstream(runs[i], ios::binary));
+        Record record;
+        if (read_record(*ins.back(), record)) {
+            heads.push(make_pair(std::move(record), i));
+        }
+    }
+    while (!heads.empty()) {
+        head_t head = heads.top();
+        heads.pop();
+        lambda(head.first);
+        if (read_record(*ins[head.second], head.first)) {
+            heads.push(std::move(head));
+        }
+    }
+}
+
+// Read every record in a file of records.
+template<typename Record>
+static void for_each_record(const string& filename, const function<void(const Record&)>& lambda) {
+    ifstream in(filename, ios::binary);
+    Record record;
+    while (read_record(in, record)) {
+        lambda(record);
+    }
+}
+
+// Delete the files of runs that have been merged.
+static void remove_runs(vector<string>& runs) {
+    for (auto& run : runs) {
+        std::remove(run.c_str());
+    }
+    runs.clear();
+}
+
+XGBuildBuffer::XGBuildBuffer(size_t memory_budget) : memory_budget(memory_budget) {
+    // Nothing to do
+}
+
+XGBuildBuffer::~XGBuildBuffer(void) {
+    for (auto& filename : temp_files) {
+        std::remove(filename.c_str());
+    }
+}
+
+// Make an empty temporary file under $TMPDIR (or /tmp) and return its name.
+static string make_temp_file(void) {
+    const char* tmpdir = getenv("TMPDIR");
+    string pattern = string(tmpdir != nullptr && *tmpdir ? tmpdir : "/tmp") + "/xg-build-XXXXXX";
+    vector<char> filename(pattern.begin(), pattern.end());
+    filename.push_back('\0');
+    int fd = mkstemp(filename.data());
+    if (fd == -1) {
+        cerr << "[xg] error: could not create temporary file " << pattern << endl;
+        exit(1);
+    }
+    close(fd);
+    return filename.data();
+}
+
+string XGBuildBuffer::temp_file(void) {
+    temp_files.push_back(make_temp_file());
+    return temp_files.back();
+}
+
+void XGBuildBuffer::add_node(id_t id, const string& sequence) {
+    assert(!finished);
+    if (memory_budget == 0) {
+        // Hint at the end, so nodes arriving in ID order go in in constant time.
+        node_label.emplace_hint(node_label.end(), id, sequence);
+    } else {
+        node_buffer.push_back(make_pair(id, sequence));
+        buffered_bytes += sizeof(node_buffer.back()) + sequence.size();
+        if (buffered_bytes >= memory_budget) spill();
+    }
+}
+
+void XGBuildBuffer::add_edge(side_t from, side_t to) {
+    assert(!finished);
+    if (memory_budget == 0) {
+        from_to.insert(from_to.end(), make_pair(from, to));
+        to_from.insert(to_from.end(), make_pair(to, from));
+    } else {
+        from_to_buffer.push_back(make_pair(from, to));
+        to_from_buffer.push_back(make_pair(to, from));
+        buffered_bytes += 2 * sizeof(from_to_buffer.back());
+        if (buffered_bytes >= memory_budget) spill();
+    }
+}
+
+size_t XGBuildBuffer::add_path(const string& name) {
+    assert(!finished);
+    auto found = path_handles.find(name);
+    if (found != path_handles.end()) {
+        return found->second;
+    }
+    size_t handle = path_names.size();
+    path_handles[name] = handle;
+    path_names.push_back(name);
+    path_last_rank.push_back(numeric_limits<int32_t>::min());
+    path_in_order.push_back(true);
+    if (memory_budget == 0) {
+        path_steps.emplace_back();
+    }
+    return handle;
+}
+
+void XGBuildBuffer::add_path_step(size_t path, const trav_t& step) {
+    assert(!finished);
+    if (trav_rank(step) < path_last_rank[path]) {
+        path_in_order[path] = false;
+    }
+    path_last_rank[path] = trav_rank(step);
+    if (memory_budget == 0) {
+        path_steps[path].push_back(step);
+    } else {
+        step_buffer.push_back(make_pair(path, step));
+        buffered_bytes += sizeof(step_buffer.back());
+        if (buffered_bytes >= memory_budget) spill();
+    }
+}
+
+void XGBuildBuffer::spill(void) {
+#ifdef VERBOSE_DEBUG
+    cerr << "spilling " << buffered_bytes << " bytes of graph to disk" << endl;
+#endif
+    if (!node_buffer.empty()) {
+        node_runs.push_back(temp_file());
+        write_run(node_buffer, node_runs.back(),
+                  [](const pair<id_t, string>& a, const pair<id_t, string>& b) { return a.first < b.first; });
+    }
+    if (!from_to_buffer.empty()) {
+        from_to_runs.push_back(temp_file());
+        write_run(from_to_buffer, from_to_runs.back(), EdgeOrder());
+        to_from_runs.push_back(temp_file());
+        write_run(to_from_buffer, to_from_runs.back(), EdgeOrder());
+    }
+    if (!step_buffer.empty()) {
+        step_runs.push_back(temp_file());
+        write_run(step_buffer, step_runs.back(), StepOrder());
+    }
+    buffered_bytes = 0;
+}
+
+void XGBuildBuffer::finish(void) {
+    assert(!finished);
+    finished = true;
+    path_count = path_names.size();
+
+    // Warn about paths that need sorting; we sort them either way.
+    for (auto& handle : path_handles) {
+        if (!path_in_order[handle.second]) {
+            cerr << "[xg] warning: path " << handle.first << " is not in sorted order by rank" << endl;
+        }
+    }
+
+    if (memory_budget == 0) {
+        node_count = node_label.size();
+        for (auto& p : node_label) {
+            seq_length += p.second.size();
+        }
+        if (!node_label.empty()) {
+            min_id = node_label.begin()->first;
+            max_id = node_label.rbegin()->first;
+        }
+        edge_count = from_to.size();
+
+        // sort the paths using mapping rank
+        // and remove duplicates
+        for (auto& handle : path_handles) {
+            vector<trav_t>& path = path_steps[handle.second];
+            std::stable_sort(path.begin(), path.end(),
+                             [](const trav_t& m1, const trav_t& m2) { return trav_rank(m1) < trav_rank(m2); });
+            auto last_unique = std::unique(path.begin(), path.end(),
+                                           [](const trav_t& m1, const trav_t& m2) {
+                                               return trav_rank(m1) == trav_rank(m2);
+                                           });
+            if (last_unique != path.end()) {
+                cerr << "[xg] error: path " << handle.first << " contains duplicate node ranks" << endl;
+                exit(1);
+            }
+        }
+        return;
+    }
+
+    spill();
+
+    // Merge each kind of run into a single deduplicated file, counting as we
+    // go.
+    node_file = temp_file();
+    {
+        ofstream out(node_file, ios::binary);
+        bool first = true;
+        merge_runs<pair<id_t, string> >(node_runs,
+            [](const pair<id_t, string>& a, const pair<id_t, string>& b) { return a.first < b.first; },
+            [&](const pair<id_t, string>& node) {
+                // Nodes come out in ID order, so max_id is the last one kept.
+                if (!first && node.first == max_id) {
+                    // Keep only the first label we got for each node
+                    return;
+                }
+                if (first) {
+                    min_id = node.first;
+                    first = false;
+                }
+                max_id = node.first;
+                ++node_count;
+                seq_length += node.second.size();
+                write_record(out, node);
+            });
+    }
+    remove_runs(node_runs);
+
+    // Both edge tables get deduplicated the same way, since a pair is
+    // duplicated in one exactly when its reverse is duplicated in the other.
+    auto merge_edges = [&](vector<string>& runs, const string& filename) {
+        ofstream out(filename, ios::binary);
+        size_t count = 0;
+        bool first = true;
+        pair<side_t, side_t> last;
+        merge_runs<pair<side_t, side_t> >(runs, EdgeOrder(), [&](const pair<side_t, side_t>& edge) {
+                if (!first && edge == last) return;
+                first = false;
+                last = edge;
+                ++count;
+                write_record(out, edge);
+            });
+        remove_runs(runs);
+        return count;
+    };
+    from_to_file = temp_file();
+    edge_count = merge_edges(from_to_runs, from_to_file);
+    to_from_file = temp_file();
+    merge_edges(to_from_runs, to_from_file);
+
+    // Steps are grouped by path handle, so we note where each path starts in
+    // order to read them back in name order.
+    step_file = temp_file();
+    path_extents.assign(path_count, make_pair((streamoff) 0, (size_t) 0));
+    {
+        ofstream out(step_file, ios::binary);
+        bool first = true;
+        pair<size_t, trav_t> last;
+        merge_runs<pair<size_t, trav_t> >(step_runs, StepOrder(), [&](const pair<size_t, trav_t>& step) {
+                if (!first && step.first == last.first) {
+                    if (trav_rank(step.second) == trav_rank(last.second)) {
+                        cerr << "[xg] error: path " << path_names[step.first] << " contains duplicate node ranks" << endl;
+                        exit(1);
+                    }
+                } else {
+                    path_extents[step.first].first = out.tellp();
+                }
+                first = false;
+                last = step;
+                ++path_extents[step.first].second;
+                write_record(out, step);
+            });
+    }
+    remove_runs(step_runs);
+}
+
+void XGBuildBuffer::for_each_node(const function<void(id_t, const string&)>& lambda) const {
+    assert(finished);
+    if (memory_budget == 0) {
+        for (auto& p : node_label) {
+            lambda(p.first, p.second);
+        }
+    } else {
+        for_each_record<pair<id_t, string> >(node_file, [&](const pair<id_t, string>& node) {
+                lambda(node.first, node.second);
+            });
+    }
+}
+
+void XGBuildBuffer::for_each_from_to(const function<void(side_t, side_t)>& lambda) const {
+    assert(finished);
+    if (memory_budget == 0) {
+        for (auto& edge : from_to) {
+            lambda(edge.first, edge.second);
+        }
+    } else {
+        for_each_record<pair<side_t, side_t> >(from_to_file, [&](const pair<side_t, side_t>& edge) {
+                lambda(edge.first, edge.second);
+            });
+    }
+}
+
+void XGBuildBuffer::for_each_to_from(const function<void(side_t, side_t)>& lambda) const {
+    assert(finished);
+    if (memory_budget == 0) {
+        for (auto& edge : to_from) {
+            lambda(edge.first, edge.second);
+        }
+    } else {
+        for_each_record<pair<side_t, side_t> >(to_from_file, [&](const pair<side_t, side_t>& edge) {
+                lambda(edge.first, edge.second);
+            });
+    }
+}
+
+void XGBuildBuffer::for_each_path(const function<void(const string&, const vector<trav_t>&)>& lambda) const {
+    assert(finished);
+    if (memory_budget == 0) {
+        for (auto& handle : path_handles) {
+            lambda(handle.first, path_steps[handle.second]);
+        }
+    } else {
+        ifstream in(step_file, ios::binary);
+        vector<trav_t> path;
+        for (auto& handle : path_handles) {
+            // Only one path needs to be in memory at a time.
+            auto& extent = path_extents[handle.second];
+            path.resize(extent.second);
+            in.clear();
+            in.seekg(extent.first);
+            pair<size_t, trav_t> step;
+            for (size_t i = 0; i < extent.second; ++i) {
+                read_record(in, step);
+                path[i] = step.second;
+            }
+            lambda(handle.first, path);
+        }
+    }
+}
+
+void XGBuildBuffer::clear_nodes(void) {
+    node_label.clear();
+}
+
+/**
+ * Reads the messages out of a stream in the format written by stream.hpp: a
+ * gzipped series of groups, each a varint count followed by that many
+ * varint-length-prefixed messages. Messages are handed back unparsed, so that
+ * the parsing can happen elsewhere.
+ */
+class RawMessageReader {
+public:
+    RawMessageReader(istream& in) : raw_in(&in), gzip_in(&raw_in) {
+        // Nothing to do
+    }
+
+    // Read the next message. Returns false at the end of the stream.
+    bool next(string& message) {
+        while (remaining_in_group == 0) {
+            if (!read_varint(remaining_in_group)) {
+                return false;
+            }
+        }
+        --remaining_in_group;
+        uint64_t message_size;
+        if (!read_varint(message_size)) {
+            throw runtime_error("stream ended in the middle of a group");
+        }
+        message.resize(message_size);
+        if (!read_bytes(&message[0], message_size)) {
+            throw runtime_error("stream ended in the middle of a message");
+        }
+        return true;
+    }
+
+private:
+    // Make sure there is buffered data. Returns false at the end of the stream.
+    bool fill(void) {
+        while (position == size) {
+            const void* next_data;
+            int next_size;
+            if (!gzip_in.Next(&next_data, &next_size)) {
+                return false;
+            }
+            data = (const char*) next_data;
+            size = next_size;
+            position = 0;
+        }
+        return true;
+    }
+
+    bool read_varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (!fill()) {
+                if (shift == 0) return false;
+                throw runtime_error("stream ended in the middle of a varint");
+            }
+            uint8_t byte = data[position++];
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        throw runtime_error("malformed varint in stream");
+    }
+
+    bool read_bytes(char* dest, size_t count) {
+        while (count > 0) {
+            if (!fill()) return false;
+            size_t available = std::min(count, size - position);
+            memcpy(dest, data + position, available);
+            position += available;
+            dest += available;
+            count -= available;
+        }
+        return true;
+    }
+
+    google::protobuf::io::IstreamInputStream raw_in;
+    google::protobuf::io::GzipInputStream gzip_in;
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t position = 0;
+    uint64_t remaining_in_group = 0;
+};
+
+void XG::from_stream(istream& in, bool validate_graph, bool print_graph,
+    bool store_threads, bool is_sorted_dag, size_t build_memory_budget) {
+
+    from_callback([&](function<void(Graph&)> handle_chunk) {
+        // Decompression has to happen in order on one thread, and so does
+        // handing chunks off, but parsing doesn't. So while the other threads
+        // parse one batch of chunks, one thread hands off the batch before it
+        // and reads the batch after it. Only three batches are ever held.
+        RawMessageReader reader(in);
+        size_t batch_size = omp_get_max_threads() * CHUNKS_PER_THREAD;
+        auto read_batch = [&](vector<string>& batch) {
+            batch.resize(batch_size);
+            size_t read = 0;
+            try {
+                while (read < batch_size && reader.next(batch[read])) {
+                    ++read;
+                }
+            } catch (runtime_error& e) {
+                cerr << "[xg] error: could not read graph: " << e.what() << endl;
+                exit(1);
+            }
+            batch.resize(read);
+        };
+
+        vector<string> to_parse;
+        vector<string> to_read;
+        vector<Graph> parsed;
+        vector<Graph> to_handle;
+        read_batch(to_parse);
+        while (!to_parse.empty() || !to_handle.empty()) {
+            parsed.resize(to_parse.size());
+#pragma omp parallel
+            {
+#pragma omp single nowait
+                {
+                    for (auto& graph : to_handle) {
+                        handle_chunk(graph);
+                    }
+                    read_batch(to_read);
+                }
+#pragma omp for schedule(dynamic, 1)
+                for (size_t i = 0; i < to_parse.size(); ++i) {
+                    if (!parsed[i].ParseFromString(to_parse[i])) {
+#pragma omp critical (cerr)
+                        cerr << "[xg] error: could not parse graph chunk" << endl;
+                        exit(1);
+                    }
+                }
+            }
+            std::swap(to_handle, parsed);
+            parsed.clear();
+            std::swap(to_parse, to_read);
+        }
+    }, validate_graph, print_graph, store_threads, is_sorted_dag, build_memory_budget);
+}
+
+// Split a GFA line into its tab-separated fields.
+static void split_gfa_line(const string& line, vector<string>& fields) {
+    fields.clear();
+    size_t start = 0;
+    while (true) {
+        size_t end = line.find('\t', start);
+        fields.push_back(line.substr(start, end == string::npos ? string::npos : end - start));
+        if (end == string::npos) break;
+        start = end + 1;
+    }
+}
+
+// Parse a GFA segment name as a node ID. Return false if it isn't one.
+static bool parse_gfa_id(const string& name, id_t& id) {
+    if (name.empty()) return false;
+    char* end = nullptr;
+    long long parsed = strtoll(name.c_str(), &end, 10);
+    if (*end != '\0' || parsed <= 0) return false;
+    id = parsed;
+    return true;
+}
+
+// Parse a GFA orientation. Return false if it isn't one.
+static bool parse_gfa_orientation(const string& orientation, bool& is_reverse) {
+    if (orientation != "+" && orientation != "-") return false;
+    is_reverse = orientation == "-";
+    return true;
+}
+
+void XG::from_gfa(istream& in, bool validate_graph, bool print_graph,
+    bool store_threads, bool is_sorted_dag, size_t build_memory_budget) {
+
+    // temporaries for construction
+    XGBuildBuffer buffer(build_memory_budget);
+
+    // GFA 1 paths carry no ranks, so we number their steps as we see them.
+    vector<int32_t> next_rank;
+
+    string line;
+    vector<string> fields;
+    size_t line_number = 0;
+    auto fail = [&](const string& message) {
+        cerr << "[xg] error: " << message << " on GFA line " << line_number << endl;
+        exit(1);
+    };
+    auto need_id = [&](const string& name) {
+        id_t id;
+        if (!parse_gfa_id(name, id)) fail("segment name " + name + " is not a numeric node ID");
+        return id;
+    };
+    auto need_orientation = [&](const string& orientation) {
+        bool is_reverse;
+        if (!parse_gfa_orientation(orientation, is_reverse)) fail("bad orientation " + orientation);
+        return is_reverse;
+    };
+
+    while (getline(in, line)) {
+        ++line_number;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.size() < 2 || line[1] != '\t') continue; // headers, comments, blank lines
+        switch (line[0]) {
+        case 'S':
+            {
+                split_gfa_line(line, fields);
+                if (fields.size() < 3) fail("truncated S line");
+                if (fields[2] == "*") fail("segment without a sequence");
+                buffer.add_node(need_id(fields[1]), fields[2]);
+            }
+            break;
+        case 'L':
+            {
+                split_gfa_line(line, fields);
+                if (fields.size() < 5) fail("truncated L line");
+                id_t from = need_id(fields[1]);
+                bool from_start = need_orientation(fields[2]);
+                id_t to = need_id(fields[3]);
+                bool to_end = need_orientation(fields[4]);
+                // Canonicalize every edge, so only canonical edges are in the index.
+                if ((from_start && to_end) || ((from_start || to_end) && from > to)) {
+                    buffer.add_edge(make_side(to, !to_end), make_side(from, !from_start));
+                } else {
+                    buffer.add_edge(make_side(from, from_start), make_side(to, to_end));
+                }
+            }
+            break;
+        case 'P':
+            {
+                split_gfa_line(line, fields);
+                bool is_reverse;
+                if (fields.size() >= 5 && parse_gfa_orientation(fields[4], is_reverse)) {
+                    // vg's form: one step per line, with its rank
+                    id_t id = need_id(fields[1]);
+                    char* end = nullptr;
+                    long rank = strtol(fields[3].c_str(), &end, 10);
+                    if (fields[3].empty() || *end != '\0') fail("bad path rank " + fields[3]);
+                    size_t path = buffer.add_path(fields[2]);
+                    buffer.add_path_step(path, make_trav(id, is_reverse, rank));
+                } else {
+                    // GFA 1 form: all the steps, comma-separated
+                    if (fields.size() < 3) fail("truncated P line");
+                    size_t path = buffer.add_path(fields[1]);
+                    if (path >= next_rank.size()) next_rank.resize(path + 1, 1);
+                    size_t start = 0;
+                    while (start < fields[2].size()) {
+                        size_t end = fields[2].find(',', start);
+                        if (end == string::npos) end = fields[2].size();
+                        if (end - start < 2) fail("bad path step");
+                        id_t id = need_id(fields[2].substr(start, end - start - 1));
+                        is_reverse = need_orientation(fields[2].substr(end - 1, 1));
+                        buffer.add_path_step(path, make_trav(id, is_reverse, next_rank[path]++));
+                        start = end + 1;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
 
-    // and set up rank/select dictionary on them
-    util::assign(offsets_rank, rank_support_v<1>(&offsets));
-    util::assign(offsets_select, bit_vector::select_1_type(&offsets));
-}
+    // sort the paths using mapping rank, and deduplicate everything
+    buffer.finish();
 
-Mapping XGPath::mapping(size_t offset) const {
-    // TODO actually store the "real" mapping
-    Mapping m;
-    // store the starting position and series of edits
-    m.mutable_position()->set_node_id(ids[offset]);
-    m.mutable_position()->set_is_reverse(directions[offset]);
-    m.set_rank(ranks[offset]);
-    return m;
+    build(buffer, validate_graph, print_graph, store_threads, is_sorted_dag);
 }
 
-size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) {
-
-    sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
-    size_t written = 0;
-    
-    // Do the magic number
-    out << "XG";
-    written += 2;
-    
-    // And the version number
-    int32_t version_buffer = htonl(OUTPUT_VERSION);
-    out.write((char*) &version_buffer, sizeof(version_buffer));
-    written += sizeof(version_buffer) / sizeof(char);
-    
-    ////////////////////////////////////////////////////////////////////////
-    // DO NOT CHANGE THIS CODE without creating a new XG version:
-    // 1. Increment OUTPUT_VERSION to a new integer.
-    // 2. Add your new serialization code.
-    // 3. Add a new case for your new version to XG::load()
-    // 4. Up MAX_INPUT_VERSION to allow your new version to be read.
-    ////////////////////////////////////////////////////////////////////////
-
-    written += sdsl::write_member(s_iv.size(), out, child, "sequence_length");
-    written += sdsl::write_member(i_iv.size(), out, child, "node_count");
-    written += sdsl::write_member(f_iv.size()-i_iv.size(), out, child, "edge_count");
-    written += sdsl::write_member(path_count, out, child, "path_count");
-    written += sdsl::write_member(min_id, out, child, "min_id");
-    written += sdsl::write_member(max_id, out, child, "max_id");
-
-    written += i_iv.serialize(out, child, "id_rank_vector");
-    written += r_iv.serialize(out, child, "rank_id_vector");
-
-    written += s_iv.serialize(out, child, "seq_vector");
-    written += s_cbv.serialize(out, child, "seq_node_starts");
-    written += s_cbv_rank.serialize(out, child, "seq_node_starts_rank");
-    written += s_cbv_select.serialize(out, child, "seq_node_starts_select");
-
-    written += f_iv.serialize(out, child, "from_vector");
-    written += f_bv.serialize(out, child, "from_node");
-    written += f_bv_rank.serialize(out, child, "from_node_rank");
-    written += f_bv_select.serialize(out, child, "from_node_select");
-    written += f_from_start_cbv.serialize(out, child, "from_is_from_start");
-    written += f_to_end_cbv.serialize(out, child, "from_is_to_end");
-    
-    written += t_iv.serialize(out, child, "to_vector");
-    written += t_bv.serialize(out, child, "to_node");
-    written += t_bv_rank.serialize(out, child, "to_node_rank");
-    written += t_bv_select.serialize(out, child, "to_node_select");
-    written += t_to_end_cbv.serialize(out, child, "to_is_to_end");
-    written += t_from_start_cbv.serialize(out, child, "to_is_from_start");
-
-    // save the thread name index
-    written += tn_csa.serialize(out, child, "thread_name_csa");
-    written += tn_cbv.serialize(out, child, "thread_name_cbv");
-    written += tn_cbv_rank.serialize(out, child, "thread_name_cbv_rank");
-    written += tn_cbv_select.serialize(out, child, "thread_name_cbv_select");
-    written += tin_civ.serialize(out, child, "thread_start_node_civ");
-    written += tio_civ.serialize(out, child, "thread_start_offset_civ");
-    written += side_thread_wt.serialize(out, child, "side_thread_wt");
-
-    // Treat the paths as their own node
-    size_t paths_written = 0;
-    auto paths_child = sdsl::structure_tree::add_child(child, "paths", sdsl::util::class_name(*this));
+void XG::merge(const vector<const XG*>& parts, bool validate_graph, bool print_graph,
+    bool store_threads, bool is_sorted_dag, size_t build_memory_budget) {
 
-    paths_written += pn_iv.serialize(out, paths_child, "path_names");
-    paths_written += pn_csa.serialize(out, paths_child, "path_names_csa");
-    paths_written += pn_bv.serialize(out, paths_child, "path_names_starts");
-    paths_written += pn_bv_rank.serialize(out, paths_child, "path_names_starts_rank");
-    paths_written += pn_bv_select.serialize(out, paths_child, "path_names_starts_select");
-    paths_written += pi_iv.serialize(out, paths_child, "path_ids");
-    paths_written += sdsl::write_member(paths.size(), out, paths_child, "path_count");    
-    for (size_t i = 0; i < paths.size(); i++) {
-        XGPath* path = paths[i];
-        paths_written += path->serialize(out, paths_child, "path:" + path_name(i + 1));
+    // Visit the parts in ID order, so everything reaches the buffer sorted.
+    vector<const XG*> ordered;
+    for (auto part : parts) {
+        if (part->node_count > 0) ordered.push_back(part);
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              [](const XG* a, const XG* b) { return a->min_id < b->min_id; });
+    for (size_t i = 1; i < ordered.size(); ++i) {
+        if (ordered[i]->min_id <= ordered[i-1]->max_id) {
+            cerr << "[xg] error: cannot merge indexes with overlapping node ID ranges "
+                 << ordered[i-1]->min_id << "-" << ordered[i-1]->max_id << " and "
+                 << ordered[i]->min_id << "-" << ordered[i]->max_id << endl;
+            exit(1);
+        }
     }
-    
-    paths_written += ep_iv.serialize(out, paths_child, "entity_path_mapping");
-    paths_written += ep_bv.serialize(out, paths_child, "entity_path_mapping_starts");
-    paths_written += ep_bv_rank.serialize(out, paths_child, "entity_path_mapping_starts_rank");
-    paths_written += ep_bv_select.serialize(out, paths_child, "entity_path_mapping_starts_select");
-    
-    sdsl::structure_tree::add_size(paths_child, paths_written);
-    written += paths_written;
 
-    // Treat the threads as their own node.
-    // This will mess up any sort of average size stats, but it will also be useful.
-    auto threads_child = sdsl::structure_tree::add_child(child, "threads", sdsl::util::class_name(*this));
-    
-    size_t threads_written = 0;
-    threads_written += h_iv.serialize(out, threads_child, "thread_usage_count");
-    threads_written += ts_iv.serialize(out, threads_child, "thread_start_count");
-    // Stick all the B_s arrays in together. Must be baked.
-    threads_written += xg::serialize(bs_single_array, out, threads_child, "bs_single_array");
-    
-    sdsl::structure_tree::add_size(threads_child, threads_written);
-    written += threads_written;
+    // temporaries for construction
+    XGBuildBuffer buffer(build_memory_budget);
 
-    sdsl::structure_tree::add_size(child, written);
-    return written;
-    
-}
+    for (auto part : ordered) {
+        for (size_t rank = 1; rank <= part->node_count; ++rank) {
+            id_t id = part->rank_to_id(rank);
+            buffer.add_node(id, part->node_sequence(id));
+        }
+        // Each node's entries in the forward table are the canonical edges
+        // leaving it, after a header entry holding its own rank.
+        size_t rank = 0;
+        for (size_t i = 0; i < part->f_iv.size(); ++i) {
+            if (part->f_bv[i]) {
+                rank = part->f_iv[i];
+                continue;
+            }
+            buffer.add_edge(make_side(part->rank_to_id(rank), part->f_from_start_cbv[i]),
+                            make_side(part->rank_to_id(part->f_iv[i]), part->f_to_end_cbv[i]));
+        }
+        // Parts may have been loaded lazily, and we read their paths directly.
+        part->ensure_paths();
+        for (size_t path_rank = 1; path_rank <= part->max_path_rank(); ++path_rank) {
+            const XGPath& xgpath = *part->paths[path_rank-1];
+            size_t path = buffer.add_path(part->path_name(path_rank));
+            for (size_t i = 0; i < xgpath.ids.size(); ++i) {
+                buffer.add_path_step(path, make_trav(xgpath.ids[i], xgpath.directions[i], xgpath.ranks[i]));
+            }
+        }
+    }
 
-void XG::from_stream(istream& in, bool validate_graph, bool print_graph,
-    bool store_threads, bool is_sorted_dag) {
+    // sort the paths using mapping rank, and deduplicate everything
+    buffer.finish();
 
-    from_callback([&](function<void(Graph&)> handle_chunk) {
-        // TODO: should I be bandying about function references instead of
-        // function objects here?
-        stream::for_each(in, handle_chunk);
-    }, validate_graph, print_graph, store_threads, is_sorted_dag);
+    build(buffer, validate_graph, print_graph, store_threads, is_sorted_dag);
 }
 
 void XG::from_graph(Graph& graph, bool validate_graph, bool print_graph,
@@ -529,40 +1905,24 @@ void XG::from_graph(Graph& graph, bool validate_graph, bool print_graph,
 
 }
 
-void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks, 
-    bool validate_graph, bool print_graph, bool store_threads, bool is_sorted_dag) {
+void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks,
+    bool validate_graph, bool print_graph, bool store_threads, bool is_sorted_dag,
+    size_t build_memory_budget) {
 
     // temporaries for construction
-    map<id_t, string> node_label;
-    // need to store node sides
-    map<side_t, set<side_t> > from_to;
-    map<side_t, set<side_t> > to_from;
-    map<string, vector<trav_t> > path_nodes;
+    XGBuildBuffer buffer(build_memory_budget);
 
     // This takes in graph chunks and adds them into our temporary storage.
-    function<void(Graph&)> lambda = [this,
-                                     &node_label,
-                                     &from_to,
-                                     &to_from,
-                                     &path_nodes](Graph& graph) {
+    function<void(Graph&)> lambda = [this, &buffer](Graph& graph) {
 
         for (int i = 0; i < graph.node_size(); ++i) {
             const Node& n = graph.node(i);
-            if (node_label.find(n.id()) == node_label.end()) {
-                ++node_count;
-                seq_length += n.sequence().size();
-                node_label[n.id()] = n.sequence();
-            }
+            buffer.add_node(n.id(), n.sequence());
         }
         for (int i = 0; i < graph.edge_size(); ++i) {
             // Canonicalize every edge, so only canonical edges are in the index.
             Edge e = canonicalize(graph.edge(i));
-            if (from_to.find(make_side(e.from(), e.from_start())) == from_to.end()
-                || from_to[make_side(e.from(), e.from_start())].count(make_side(e.to(), e.to_end())) == 0) {
-                ++edge_count;
-                from_to[make_side(e.from(), e.from_start())].insert(make_side(e.to(), e.to_end()));
-                to_from[make_side(e.to(), e.to_end())].insert(make_side(e.from(), e.from_start()));
-            }
+            buffer.add_edge(make_side(e.from(), e.from_start()), make_side(e.to(), e.to_end()));
         }
 
         // Print out all the paths in the graph we are loading
@@ -572,10 +1932,10 @@ void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks,
 #ifdef VERBOSE_DEBUG
             cerr << "Path " << name << ": ";
 #endif
-            vector<trav_t>& path = path_nodes[name];
+            size_t path = buffer.add_path(name);
             for (int j = 0; j < p.mapping_size(); ++j) {
                 const Mapping& m = p.mapping(j);
-                path.push_back(make_trav(m.position().node_id(), m.position().is_reverse(), m.rank()));
+                buffer.add_path_step(path, make_trav(m.position().node_id(), m.position().is_reverse(), m.rank()));
 #ifdef VERBOSE_DEBUG
                 cerr << m.position().node_id() * 2 + m.position().is_reverse() << "; ";
 #endif
@@ -590,33 +1950,12 @@ void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks,
     // Get all the chunks via the callback, and have them called back to us.
     // The other end handles figuring out how much to loop.
     get_chunks(lambda);
-    
-    path_count = path_nodes.size();
-    
-    // sort the paths using mapping rank
-    // and remove duplicates
-    for (auto& p : path_nodes) {
-        vector<trav_t>& path = path_nodes[p.first];
-        if (!std::is_sorted(path.begin(), path.end(),
-                            [](const trav_t& m1, const trav_t& m2) { return trav_rank(m1) < trav_rank(m2); })) {
-            cerr << "[xg] warning: path " << p.first << " is not in sorted order by rank" << endl;
-            std::sort(path.begin(), path.end(),
-                      [](const trav_t& m1, const trav_t& m2) { return trav_rank(m1) < trav_rank(m2); });
-        }
-        auto last_unique = std::unique(path.begin(), path.end(),
-                                       [](const trav_t& m1, const trav_t& m2) {
-                                           return trav_rank(m1) == trav_rank(m2);
-                                       });
-        
-        if (last_unique != path.end()) {
-            cerr << "[xg] error: path " << p.first << " contains duplicate node ranks" << endl;
-            exit(1);
-        }
-    }
 
-    build(node_label, from_to, to_from, path_nodes, validate_graph, print_graph,
-        store_threads, is_sorted_dag);
-    
+    // sort the paths using mapping rank, and deduplicate everything
+    buffer.finish();
+
+    build(buffer, validate_graph, print_graph, store_threads, is_sorted_dag);
+
 }
 
 void XG::build(map<id_t, string>& node_label,
@@ -628,6 +1967,47 @@ void XG::build(map<id_t, string>& node_label,
                bool store_threads,
                bool is_sorted_dag) {
 
+    XGBuildBuffer buffer;
+    for (auto& p : node_label) {
+        buffer.add_node(p.first, p.second);
+    }
+    node_label.clear();
+    // to_from is just the reverse of from_to
+    for (auto& p : from_to) {
+        for (auto& to : p.second) {
+            buffer.add_edge(p.first, to);
+        }
+    }
+    from_to.clear();
+    to_from.clear();
+    for (auto& p : path_nodes) {
+        size_t path = buffer.add_path(p.first);
+        for (auto& step : p.second) {
+            buffer.add_path_step(path, step);
+        }
+    }
+    path_nodes.clear();
+    buffer.finish();
+
+    build(buffer, validate_graph, print_graph, store_threads, is_sorted_dag);
+}
+
+// How many bits do we need to store values up to max_value?
+static uint8_t bits_needed(uint64_t max_value) {
+    return max_value == 0 ? 1 : bits::hi(max_value) + 1;
+}
+
+void XG::build(XGBuildBuffer& buffer,
+               bool validate_graph,
+               bool print_graph,
+               bool store_threads,
+               bool is_sorted_dag) {
+
+    seq_length = buffer.seq_length;
+    node_count = buffer.node_count;
+    edge_count = buffer.edge_count;
+    path_count = buffer.path_count;
+
     size_t entity_count = node_count + edge_count;
 #ifdef VERBOSE_DEBUG
     cerr << "graph has " << seq_length << "bp in sequence, "
@@ -638,23 +2018,30 @@ void XG::build(map<id_t, string>& node_label,
 #endif
 
     // for mapping of ids to ranks using a vector rather than wavelet tree
-    min_id = node_label.begin()->first;
-    max_id = node_label.rbegin()->first;
-    
+    min_id = buffer.min_id;
+    max_id = buffer.max_id;
+
     // set up our compressed representation
-    util::assign(s_iv, int_vector<>(seq_length, 0, 3));
+    // The integer vectors start out at their final widths, so we never hold
+    // 64-bit versions of them.
+    util::assign(s_iv, int_vector<2>(seq_length, 0));
     util::assign(s_bv, bit_vector(seq_length));
-    util::assign(i_iv, int_vector<>(node_count));
-    util::assign(r_iv, int_vector<>(max_id-min_id+1)); // note possibly discontiguous
-    util::assign(f_iv, int_vector<>(entity_count));
+    util::assign(i_iv, int_vector<>(node_count, 0, bits_needed(max_id)));
+    // note possibly discontiguous
+    // If the IDs are sparse, we don't want a vector over the whole ID range.
+    sparse_ids = max_id - min_id + 1 > node_count * SPARSE_ID_RANGE_FACTOR;
+    if (!sparse_ids) {
+        util::assign(r_iv, int_vector<>(max_id-min_id+1, 0, bits_needed(node_count)));
+    }
+    util::assign(f_iv, int_vector<>(entity_count, 0, bits_needed(node_count)));
     util::assign(f_bv, bit_vector(entity_count));
     util::assign(f_from_start_bv, bit_vector(entity_count));
     util::assign(f_to_end_bv, bit_vector(entity_count));
-    util::assign(t_iv, int_vector<>(entity_count));
+    util::assign(t_iv, int_vector<>(entity_count, 0, bits_needed(node_count)));
     util::assign(t_bv, bit_vector(entity_count));
     util::assign(t_to_end_bv, bit_vector(entity_count));
     util::assign(t_from_start_bv, bit_vector(entity_count));
-    
+
     // for each node in the sequence
     // concatenate the labels into the s_iv
 #ifdef VERBOSE_DEBUG
@@ -662,97 +2049,158 @@ void XG::build(map<id_t, string>& node_label,
 #endif
     size_t i = 0; // insertion point
     size_t r = 1;
-    for (auto& p : node_label) {
-        int64_t id = p.first;
-        const string& l = p.second;
+    vector<uint64_t> n_positions;
+    buffer.for_each_node([&](id_t id, const string& l) {
         s_bv[i] = 1; // record node start
         i_iv[r-1] = id;
         // store ids to rank mapping
-        r_iv[id-min_id] = r;
+        if (!sparse_ids) r_iv[id-min_id] = r;
         ++r;
         for (auto c : l) {
-            s_iv[i++] = dna3bit(c); // store sequence
+            // store sequence, noting where the Ns go
+            int code = dna3bit(c);
+            if (code > 3) {
+                n_positions.push_back(i);
+                code = 0;
+            }
+            s_iv[i++] = code;
         }
-    }
+    });
+    index_n_positions(n_positions);
+    n_positions.clear();
+    n_positions.shrink_to_fit();
     // keep only if we need to validate the graph
-    if (!validate_graph) node_label.clear();
+    if (!validate_graph) buffer.clear_nodes();
 
     // we have to process all the nodes before we do the edges
     // because we need to ensure full coverage of node space
 
+    if (sparse_ids) {
+        // Mark the IDs that are present; a node's rank is its ID's rank.
+        vector<uint64_t> id_offsets(node_count);
+        for (size_t k = 0; k < node_count; ++k) {
+            id_offsets[k] = i_iv[k] - min_id;
+        }
+        util::assign(r_sdv, sd_vector<>(id_offsets.begin(), id_offsets.end()));
+    }
+    util::assign(r_sdv_rank, sd_vector<>::rank_1_type(&r_sdv));
+
     util::bit_compress(i_iv);
     util::bit_compress(r_iv);
 
-#ifdef VERBOSE_DEBUG    
-    cerr << "storing forward edges and adjacency table" << endl;
-#endif
-    size_t f_itr = 0;
-    size_t j_itr = 0; // edge adjacency pointer
-    for (size_t k = 0; k < node_count; ++k) {
-        int64_t f_id = i_iv[k];
-        size_t f_rank = k+1;
-        f_iv[f_itr] = f_rank;
-        f_bv[f_itr] = 1;
-        ++f_itr;
-        for (auto end : { false, true }) {
-            if (from_to.find(make_side(f_id, end)) != from_to.end()) {
-                auto t_side_itr = from_to.find(make_side(f_id, end));
-                if (t_side_itr != from_to.end()) {
-                    for (auto& t_side : t_side_itr->second) {
-                        size_t t_rank = id_to_rank(side_id(t_side));
-                        // store link
-                        f_iv[f_itr] = t_rank;
-                        f_bv[f_itr] = 0;
-                        // store side for start of edge
-                        f_from_start_bv[f_itr] = end;
-                        f_to_end_bv[f_itr] = side_is_end(t_side);
-                        ++f_itr;
-                    }
-                }
+    // Edges come out of the buffer grouped by node in ID order, which is also
+    // rank order, so we lay them down after their nodes' entries, filling in
+    // entries for any nodes in between that have no edges.
+    auto has_node = [&](id_t id) {
+        return id >= min_id && id <= max_id && id_to_rank(id) != 0;
+    };
+
+    // The forward and reverse edge tables, the sequence rank/select supports
+    // and the sequence FM-index don't depend on each other, so we build them
+    // at the same time.
+#pragma omp parallel sections
+    {
+#pragma omp section
+        {
+            if (index_sequence) {
+                build_sequence_index();
             }
         }
-    }
 
-    // compress the forward direction side information
-    util::assign(f_from_start_cbv, sd_vector<>(f_from_start_bv));
-    util::assign(f_to_end_cbv, sd_vector<>(f_to_end_bv));
-    
-    //assert(e_iv.size() == edge_count*3);
+#pragma omp section
+        {
 #ifdef VERBOSE_DEBUG
-    cerr << "storing reverse edges" << endl;
-#endif
-
-    size_t t_itr = 0;
-    for (size_t k = 0; k < node_count; ++k) {
-        //cerr << k << endl;
-        int64_t t_id = i_iv[k];
-        size_t t_rank = k+1;
-        t_iv[t_itr] = t_rank;
-        t_bv[t_itr] = 1;
-        ++t_itr;
-        for (auto end : { false, true }) {
-            if (to_from.find(make_side(t_id, end)) != to_from.end()) {
-                auto f_side_itr = to_from.find(make_side(t_id, end));
-                if (f_side_itr != to_from.end()) {
-                    for (auto& f_side : f_side_itr->second) {
-                        size_t f_rank = id_to_rank(side_id(f_side));
-                        // store link
-                        t_iv[t_itr] = f_rank;
-                        t_bv[t_itr] = 0;
-                        // store side for end of edge
-                        t_to_end_bv[t_itr] = end;
-                        t_from_start_bv[t_itr] = side_is_end(f_side);
-                        ++t_itr;
-                    }
+#pragma omp critical (cerr)
+            cerr << "storing forward edges and adjacency table" << endl;
+#endif
+            size_t f_itr = 0;
+            size_t f_rank = 0; // last node laid down
+            auto f_nodes_through = [&](size_t rank) {
+                while (f_rank < rank) {
+                    f_iv[f_itr] = ++f_rank;
+                    f_bv[f_itr] = 1;
+                    ++f_itr;
+                }
+            };
+            buffer.for_each_from_to([&](side_t f_side, side_t t_side) {
+                if (!has_node(side_id(f_side))) return;
+                f_nodes_through(id_to_rank(side_id(f_side)));
+                size_t t_rank = id_to_rank(side_id(t_side));
+                // store link
+                f_iv[f_itr] = t_rank;
+                f_bv[f_itr] = 0;
+                // store side for start of edge
+                f_from_start_bv[f_itr] = side_is_end(f_side);
+                f_to_end_bv[f_itr] = side_is_end(t_side);
+                ++f_itr;
+            });
+            f_nodes_through(node_count);
+
+            // compress the forward direction side information
+            util::assign(f_from_start_cbv, sd_vector<>(f_from_start_bv));
+            util::assign(f_to_end_cbv, sd_vector<>(f_to_end_bv));
+
+            util::bit_compress(f_iv);
+            util::assign(f_bv_rank, rank_support_v<1>(&f_bv));
+            util::assign(f_bv_select, bit_vector::select_1_type(&f_bv));
+        }
+
+#pragma omp section
+        {
+#ifdef VERBOSE_DEBUG
+#pragma omp critical (cerr)
+            cerr << "storing reverse edges" << endl;
+#endif
+            size_t t_itr = 0;
+            size_t t_rank = 0; // last node laid down
+            auto t_nodes_through = [&](size_t rank) {
+                while (t_rank < rank) {
+                    t_iv[t_itr] = ++t_rank;
+                    t_bv[t_itr] = 1;
+                    ++t_itr;
                 }
+            };
+            buffer.for_each_to_from([&](side_t t_side, side_t f_side) {
+                if (!has_node(side_id(t_side))) return;
+                t_nodes_through(id_to_rank(side_id(t_side)));
+                size_t f_rank = id_to_rank(side_id(f_side));
+                // store link
+                t_iv[t_itr] = f_rank;
+                t_bv[t_itr] = 0;
+                // store side for end of edge
+                t_to_end_bv[t_itr] = side_is_end(t_side);
+                t_from_start_bv[t_itr] = side_is_end(f_side);
+                ++t_itr;
+            });
+            t_nodes_through(node_count);
+
+            // compress the reverse direction side information
+            util::assign(t_to_end_cbv, sd_vector<>(t_to_end_bv));
+            util::assign(t_from_start_cbv, sd_vector<>(t_from_start_bv));
+
+            util::bit_compress(t_iv);
+            util::assign(t_bv_rank, rank_support_v<1>(&t_bv));
+            util::assign(t_bv_select, bit_vector::select_1_type(&t_bv));
+        }
+
+#pragma omp section
+        {
+            util::assign(s_bv_rank, rank_support_v<1>(&s_bv));
+            util::assign(s_bv_select, bit_vector::select_1_type(&s_bv));
+
+            // compressed vectors of the above
+            //vlc_vector<> s_civ(s_iv);
+            util::assign(s_cbv, rrr_vector<>(s_bv));
+            util::assign(s_cbv_rank, rrr_vector<>::rank_1_type(&s_cbv));
+            util::assign(s_cbv_select, rrr_vector<>::select_1_type(&s_cbv));
+            if (dense_node_starts) {
+                index_node_starts();
             }
         }
     }
 
-    // compress the reverse direction side information
-    util::assign(t_to_end_cbv, sd_vector<>(t_to_end_bv));
-    util::assign(t_from_start_cbv, sd_vector<>(t_from_start_bv));
-
+    // Regroup the edges by side, now that both tables are done
+    index_side_adjacency();
 
     /*
     csa_wt<wt_int<rrr_vector<63>>> csa;
@@ -768,27 +2216,6 @@ void XG::build(map<id_t, string>& node_label,
     construct_im(e_csa, e_iv, 1);
     */
 
-    // to label the paths we'll need to compress and index our vectors
-    util::bit_compress(s_iv);
-    util::bit_compress(f_iv);
-    util::bit_compress(t_iv);
-    //util::bit_compress(e_iv);
-
-    //construct_im(e_csa, e_iv, 8);
-
-    util::assign(s_bv_rank, rank_support_v<1>(&s_bv));
-    util::assign(s_bv_select, bit_vector::select_1_type(&s_bv));
-    util::assign(f_bv_rank, rank_support_v<1>(&f_bv));
-    util::assign(f_bv_select, bit_vector::select_1_type(&f_bv));
-    util::assign(t_bv_rank, rank_support_v<1>(&t_bv));
-    util::assign(t_bv_select, bit_vector::select_1_type(&t_bv));
-    
-    // compressed vectors of the above
-    //vlc_vector<> s_civ(s_iv);
-    util::assign(s_cbv, rrr_vector<>(s_bv));
-    util::assign(s_cbv_rank, rrr_vector<>::rank_1_type(&s_cbv));
-    util::assign(s_cbv_select, rrr_vector<>::select_1_type(&s_cbv));
-
 // Prepare empty vectors for path indexing
 #ifdef VERBOSE_DEBUG
     cerr << "creating empty succinct thread store" << endl;
@@ -808,57 +2235,60 @@ void XG::build(map<id_t, string>& node_label,
     // paths
     //path_nodes[name].push_back(m.position().node_id());
     string path_names;
-    size_t path_entities = 0; // count of nodes and edges
-    for (auto& pathpair : path_nodes) {
+    // Paths are independent, so we construct them in parallel. We pull them
+    // from the buffer in batches of one per thread, so that we don't need to
+    // hold all the paths' steps at once.
+    vector<pair<string, vector<trav_t> > > path_batch;
+    auto build_path_batch = [&](void) {
+        vector<XGPath*> built(path_batch.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t k = 0; k < path_batch.size(); ++k) {
+            built[k] = new XGPath(path_batch[k].first, path_batch[k].second, entity_count, *this);
+        }
+        paths.insert(paths.end(), built.begin(), built.end());
+        path_batch.clear();
+    };
+    buffer.for_each_path([&](const string& path_name, const vector<trav_t>& path_steps) {
         // add path name
-        const string& path_name = pathpair.first;
         //cerr << path_name << endl;
         path_names += start_marker + path_name + end_marker;
-        // The path constructor helpfully counts unique path members for us
-        size_t unique_member_count;
-        XGPath* path = new XGPath(path_name, pathpair.second, entity_count, *this, &unique_member_count);
-        paths.push_back(path);
-        path_entities += unique_member_count;
-    }
-
-    // handle path names
-    util::assign(pn_iv, int_vector<>(path_names.size()));
-    util::assign(pn_bv, bit_vector(path_names.size()));
-    // now record path name starts
-    for (size_t i = 0; i < path_names.size(); ++i) {
-        pn_iv[i] = path_names[i];
-        if (path_names[i] == start_marker) {
-            pn_bv[i] = 1; // register name start
-        }
-    }
-    util::assign(pn_bv_rank, rank_support_v<1>(&pn_bv));
-    util::assign(pn_bv_select, bit_vector::select_1_type(&pn_bv));
-    
-    //util::bit_compress(pn_iv);
-    string path_name_file = "@pathnames.iv";
-    store_to_file((const char*)path_names.c_str(), path_name_file);
-    construct(pn_csa, path_name_file, 1);
-
-    // entity -> paths
-    util::assign(ep_iv, int_vector<>(path_entities+entity_count));
-    util::assign(ep_bv, bit_vector(path_entities+entity_count));
-    size_t ep_off = 0;
-    for (size_t i = 0; i < entity_count; ++i) {
-        ep_bv[ep_off] = 1;
-        ep_iv[ep_off] = 0; // null so we can detect entities with no path membership
-        ++ep_off;
-        for (size_t j = 0; j < paths.size(); ++j) {
-            if (paths[j]->members[i] == 1) {
-                ep_iv[ep_off++] = j+1;
+        path_batch.emplace_back(path_name, path_steps);
+        if (path_batch.size() >= (size_t) omp_get_max_threads()) {
+            build_path_batch();
+        }
+    });
+    build_path_batch();
+
+    // The path name index and the entity to path index are independent.
+#pragma omp parallel sections
+    {
+#pragma omp section
+        {
+            // handle path names
+            util::assign(pn_iv, int_vector<>(path_names.size()));
+            util::assign(pn_bv, bit_vector(path_names.size()));
+            // now record path name starts
+            for (size_t i = 0; i < path_names.size(); ++i) {
+                pn_iv[i] = path_names[i];
+                if (path_names[i] == start_marker) {
+                    pn_bv[i] = 1; // register name start
+                }
             }
+            util::assign(pn_bv_rank, rank_support_v<1>(&pn_bv));
+            util::assign(pn_bv_select, bit_vector::select_1_type(&pn_bv));
+    
+            //util::bit_compress(pn_iv);
+            // Build the csa in memory, like the thread names in tn_bake()
+#pragma omp critical (construct_im)
+            construct_im(pn_csa, path_names, 1);
         }
-    }
 
-    util::bit_compress(ep_iv);
-    //cerr << ep_off << " " << path_entities << " " << entity_count << endl;
-    assert(ep_off <= path_entities+entity_count);
-    util::assign(ep_bv_rank, rank_support_v<1>(&ep_bv));
-    util::assign(ep_bv_select, bit_vector::select_1_type(&ep_bv));
+#pragma omp section
+        {
+            // entity -> paths
+            index_entity_paths(entity_count);
+        }
+    }
 
     if(store_threads) {
 
@@ -873,11 +2303,11 @@ void XG::build(map<id_t, string>& node_label,
     
         // Just store all the paths that are all perfect mappings as threads.
         // We end up converting *back* into thread_t objects.
-        for (auto& pathpair : path_nodes) {
+        buffer.for_each_path([&](const string& path_name, const vector<trav_t>& path_steps) {
             thread_t reconstructed;
             
             // Grab the trav_ts, which are now sorted by rank
-            for (auto& m : pathpair.second) {
+            for (auto& m : path_steps) {
                 // Convert the mapping to a ThreadMapping
                 // trav_ts are already rank sorted and deduplicated.
                 ThreadMapping mapping = {trav_id(m), trav_is_rev(m)};
@@ -885,31 +2315,30 @@ void XG::build(map<id_t, string>& node_label,
             }
             
 #if GPBWT_MODE == MODE_SDSL
-            if(is_sorted_dag) {
-                // Save for a batch insert
-                batch.push_back(reconstructed);
-                batch_names.push_back(pathpair.first);
-            }
-            // TODO: else case!
+            // Save for a batch insert
+            batch.push_back(reconstructed);
+            batch_names.push_back(path_name);
 #elif GPBWT_MODE == MODE_DYNAMIC
             // Insert the thread right now
-            insert_thread(reconstructed, pathpair.first);
+            insert_thread(reconstructed, path_name);
 #endif
             
-        }
+        });
         
 #if GPBWT_MODE == MODE_SDSL
+        // Do the batch insert
         if(is_sorted_dag) {
-            // Do the batch insert
             insert_threads_into_dag(batch, batch_names);
+        } else {
+            insert_threads_into_graph(batch, batch_names);
         }
-        // TODO: else case!
 #endif
     }
     
 
 #ifdef DEBUG_CONSTRUCTION
     cerr << "|s_iv| = " << size_in_mega_bytes(s_iv) << endl;
+    cerr << "|sn_sdv| = " << size_in_mega_bytes(sn_sdv) << endl;
     cerr << "|f_iv| = " << size_in_mega_bytes(f_iv) << endl;
     cerr << "|t_iv| = " << size_in_mega_bytes(t_iv) << endl;
 
@@ -926,6 +2355,7 @@ void XG::build(map<id_t, string>& node_label,
     
     cerr << "|h_iv| = " << size_in_mega_bytes(h_iv) << endl;
     cerr << "|ts_iv| = " << size_in_mega_bytes(ts_iv) << endl;
+    cerr << "|tn_csa| = " << size_in_mega_bytes(tn_csa) << endl;
 
     long double paths_mb_size = 0;
     cerr << "|pn_iv| = " << size_in_mega_bytes(pn_iv) << endl;
@@ -949,6 +2379,7 @@ void XG::build(map<id_t, string>& node_label,
     
     cerr << "total size [MB] = " << (
         size_in_mega_bytes(s_iv)
+        + size_in_mega_bytes(sn_sdv)
         + size_in_mega_bytes(f_iv)
         + size_in_mega_bytes(t_iv)
         //+ size_in_mega_bytes(s_bv)
@@ -969,7 +2400,7 @@ void XG::build(map<id_t, string>& node_label,
         cerr << "printing graph" << endl;
         cerr << s_iv << endl;
         for (int i = 0; i < s_iv.size(); ++i) {
-            cerr << revdna3bit(s_iv[i]);
+            cerr << base_at(i);
         } cerr << endl;
         cerr << s_bv << endl;
         cerr << i_iv << endl;
@@ -995,136 +2426,217 @@ void XG::build(map<id_t, string>& node_label,
     }
 
     if (validate_graph) {
+        // Entities are checked in parallel, a batch at a time, so we never
+        // have to hold all of the buffer in memory. Which ones get checked
+        // is decided in order here, so a given fraction always checks the
+        // same entities.
+        const size_t batch_size = 1 << 16;
+        mt19937_64 sampler(0);
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        auto sampled = [&](void) {
+            return validate_fraction >= 1.0 || unit(sampler) < validate_fraction;
+        };
+        size_t entities_seen = 0;
+        size_t entities_checked = 0;
+        size_t failures = 0;
+        auto fail = [&](const string& message) {
+#pragma omp critical (validate_report)
+            {
+                cerr << message << endl;
+                ++failures;
+            }
+        };
+
         cerr << "validating graph sequence" << endl;
-        int max_id = s_cbv_rank(s_cbv.size());
-        for (auto& p : node_label) {
-            int64_t id = p.first;
-            const string& l = p.second;
-            //size_t rank = node_rank[id];
-            size_t rank = id_to_rank(id);
-            //cerr << rank << endl;
-            // find the node in the array
-            //cerr << "id = " << id << " rank = " << s_cbv_select(rank) << endl;
-            // this should be true given how we constructed things
-            if (rank != s_cbv_rank(s_cbv_select(rank)+1)) {
-                cerr << rank << " != " << s_cbv_rank(s_cbv_select(rank)+1) << " for node " << id << endl;
-                assert(false);
-            }
-            // get the sequence from the s_iv
-            string s = node_sequence(id);
-
-            string ltmp, stmp;
-            if (l.size() != s.size()) {
-                cerr << l << " != " << endl << s << endl << " for node " << id << endl;
-                assert(false);
-            } else {
-                int j = 0;
-                for (auto c : l) {
-                    if (dna3bit(c) != dna3bit(s[j++])) {
-                        cerr << l << " != " << endl << s << endl << " for node " << id << endl;
-                        assert(false);
+        vector<pair<id_t, string>> node_batch;
+        auto check_nodes = [&](void) {
+#pragma omp parallel for schedule(dynamic, 256)
+            for (size_t k = 0; k < node_batch.size(); ++k) {
+                id_t id = node_batch[k].first;
+                const string& l = node_batch[k].second;
+                size_t rank = id_to_rank(id);
+                // this should be true given how we constructed things
+                if (rank == 0 || rank != s_cbv_rank(s_cbv_select(rank)+1)) {
+                    fail("bad rank " + to_string(rank) + " for node " + to_string(id));
+                    continue;
+                }
+                size_t start = s_cbv_select(rank);
+                size_t length = (rank == node_count ? seq_length : s_cbv_select(rank+1)) - start;
+                bool same = l.size() == length;
+                if (same) {
+                    string stored(length, '\0');
+                    decode_sequence(start, start + length, &stored[0]);
+                    for (size_t j = 0; same && j < length; ++j) {
+                        same = dna3bit(l[j]) == dna3bit(stored[j]);
+                    }
+                    if (same) {
+                        // Views of the node must read the same bases, on
+                        // both strands, however they are walked.
+                        typedef std::reverse_iterator<SequenceView::const_iterator> backwards;
+                        SequenceView forward = node_view(id);
+                        SequenceView reverse = node_view(id, true);
+                        string flipped = xg::reverse_complement(stored);
+                        bool views_agree = string(forward.begin(), forward.end()) == stored
+                            && string(backwards(forward.end()), backwards(forward.begin()))
+                                == string(stored.rbegin(), stored.rend())
+                            && string(reverse.begin(), reverse.end()) == flipped
+                            && forward.reverse_complement().str() == flipped
+                            && reverse.reverse_complement().str() == stored
+                            && reverse.substr(length / 2).str() == flipped.substr(length / 2)
+                            && forward.substr(length / 2).str() == stored.substr(length / 2);
+                        if (!views_agree) {
+                            fail("sequence views disagree with the stored sequence for node " + to_string(id));
+                        }
                     }
                 }
+                if (!same) {
+                    fail(l + " != \n" + node_sequence(id) + "\n for node " + to_string(id));
+                }
             }
-        }
-        node_label.clear();
+            entities_checked += node_batch.size();
+            node_batch.clear();
+        };
+        buffer.for_each_node([&](id_t id, const string& l) {
+            ++entities_seen;
+            if (!sampled()) return;
+            node_batch.push_back(make_pair(id, l));
+            if (node_batch.size() == batch_size) check_nodes();
+        });
+        check_nodes();
+        buffer.clear_nodes();
+
+        // The edges come out of the buffer in the same order we laid them
+        // down, so each one has to match the next edge entry in the table.
+        // We find the entries in order, and check them in parallel. Edges
+        // touching missing nodes were skipped, or stored without a rank to
+        // check against, so we pass over them the same way here.
+        vector<tuple<size_t, side_t, side_t>> edge_batch;
+        auto describe = [&](side_t from, side_t to) {
+            return to_string(side_id(from)) + (side_is_end(from) ? "+" : "-")
+                + " -> " + to_string(side_id(to)) + (side_is_end(to) ? "+" : "-");
+        };
+        auto check_edges = [&](bool forward) {
+            const int_vector<>& iv = forward ? f_iv : t_iv;
+            const rank_support_v<1>& bv_rank = forward ? f_bv_rank : t_bv_rank;
+            const bit_vector& here_bv = forward ? f_from_start_bv : t_to_end_bv;
+            const bit_vector& there_bv = forward ? f_to_end_bv : t_from_start_bv;
+#pragma omp parallel for schedule(dynamic, 256)
+            for (size_t k = 0; k < edge_batch.size(); ++k) {
+                size_t j = get<0>(edge_batch[k]);
+                side_t here = get<1>(edge_batch[k]);
+                side_t there = get<2>(edge_batch[k]);
+                if (j == iv.size()) {
+                    fail(string("could not find edge (") + (forward ? "f" : "t") + ") "
+                         + (forward ? describe(here, there) : describe(there, here)));
+                    continue;
+                }
+                // The node we're at is given by the entry's rank, and the
+                // other one by the entry.
+                side_t found_here = make_side(i_iv[bv_rank(j)-1], here_bv[j]);
+                side_t found_there = make_side(i_iv[iv[j]-1], there_bv[j]);
+                if (found_here != here || found_there != there) {
+                    fail(string("could not find edge (") + (forward ? "f" : "t") + ") "
+                         + (forward ? describe(found_here, found_there) : describe(found_there, found_here)));
+                }
+            }
+            entities_checked += edge_batch.size();
+            edge_batch.clear();
+        };
 
-        // -1 here seems weird
-        // what?
         cerr << "validating forward edge table" << endl;
-        for (size_t j = 0; j < f_iv.size()-1; ++j) {
-            if (f_bv[j] == 1) continue;
-            // from id == rank
-            size_t fid = i_iv[f_bv_rank(j)-1];
-            // to id == f_cbv[j]
-            size_t tid = i_iv[f_iv[j]-1];
-            bool from_start = f_from_start_bv[j];
-            // get the to_end
-            bool to_end = false;
-            for (auto& side : from_to[make_side(fid, from_start)]) {
-                if (side_id(side) == tid) {
-                    to_end = side_is_end(side);
+        size_t j = 0;
+        buffer.for_each_from_to([&](side_t f_side, side_t t_side) {
+            if (!has_node(side_id(f_side))) return;
+            while (j < f_iv.size() && f_bv[j] == 1) ++j;
+            if (has_node(side_id(t_side))) {
+                ++entities_seen;
+                if (sampled()) {
+                    edge_batch.push_back(make_tuple(j, f_side, t_side));
+                    if (edge_batch.size() == batch_size) check_edges(true);
                 }
             }
-            if (from_to[make_side(fid, from_start)].count(make_side(tid, to_end)) == 0) {
-                cerr << "could not find edge (f) "
-                     << fid << (from_start ? "+" : "-")
-                     << " -> "
-                     << tid << (to_end ? "+" : "-")
-                     << endl;
-                assert(false);
-            }
-        }
+            if (j < f_iv.size()) ++j;
+        });
+        check_edges(true);
 
         cerr << "validating reverse edge table" << endl;
-        for (size_t j = 0; j < t_iv.size()-1; ++j) {
-            //cerr << j << endl;
-            if (t_bv[j] == 1) continue;
-            // from id == rank
-            size_t tid = i_iv[t_bv_rank(j)-1];
-            // to id == f_cbv[j]
-            size_t fid = i_iv[t_iv[j]-1];
-            //cerr << tid << " " << fid << endl;
-
-            bool to_end = t_to_end_bv[j];
-            // get the to_end
-            bool from_start = false;
-            for (auto& side : to_from[make_side(tid, to_end)]) {
-                if (side_id(side) == fid) {
-                    from_start = side_is_end(side);
+        j = 0;
+        buffer.for_each_to_from([&](side_t t_side, side_t f_side) {
+            if (!has_node(side_id(t_side))) return;
+            while (j < t_iv.size() && t_bv[j] == 1) ++j;
+            if (has_node(side_id(f_side))) {
+                ++entities_seen;
+                if (sampled()) {
+                    edge_batch.push_back(make_tuple(j, t_side, f_side));
+                    if (edge_batch.size() == batch_size) check_edges(false);
                 }
             }
-            if (to_from[make_side(tid, to_end)].count(make_side(fid, from_start)) == 0) {
-                cerr << "could not find edge (t) "
-                     << fid << (from_start ? "+" : "-")
-                     << " -> "
-                     << tid << (to_end ? "+" : "-")
-                     << endl;
-                assert(false);
-            }
-        }
+            if (j < t_iv.size()) ++j;
+        });
+        check_edges(false);
     
         cerr << "validating paths" << endl;
-        for (auto& pathpair : path_nodes) {
-            const string& name = pathpair.first;
-            auto& path = pathpair.second;
+        buffer.for_each_path([&](const string& name, const vector<trav_t>& path) {
             size_t prank = path_rank(name);
-            //cerr << path_name(prank) << endl;
-            assert(path_name(prank) == name);
-            rrr_vector<>& pe_bv = paths[prank-1]->members;
-            int_vector<>& pp_iv = paths[prank-1]->positions;
-            sd_vector<>& dir_bv = paths[prank-1]->directions;
-            // check each entity in the nodes is present
-            // and check node reported at the positions in it
+            if (prank == 0 || path_name(prank) != name) {
+                fail("could not find path " + name);
+                return;
+            }
+            const XGPath& xgpath = *paths[prank-1];
+            // Lay out where each step should start
+            vector<size_t> starts(path.size());
+            vector<bool> check(path.size());
             size_t pos = 0;
-            size_t in_path = 0;
-            for (auto& m : path) {
-                int64_t id = trav_id(m);
-                bool rev = trav_is_rev(m);
-                // todo rank
-                assert(pe_bv[node_rank_as_entity(id)-1]);
-                assert(dir_bv[in_path] == rev);
-                Node n = node(id);
-                //cerr << id << " in " << name << endl;
-                auto p = position_in_path(id, name);
-                assert(std::find(p.begin(), p.end(), pos) != p.end());
-                for (size_t k = 0; k < n.sequence().size(); ++k) {
-                    //cerr << "id " << id << " ==? " << node_at_path_position(name, pos+k) << endl;
-                    assert(id == node_at_path_position(name, pos+k));
-                    assert(id == mapping_at_path_position(name, pos+k).position().node_id());
+            for (size_t k = 0; k < path.size(); ++k) {
+                starts[k] = pos;
+                pos += node_length(trav_id(path[k]));
+                ++entities_seen;
+                check[k] = sampled();
+            }
+            size_t path_checked = 0;
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+:path_checked)
+            for (size_t k = 0; k < path.size(); ++k) {
+                if (!check[k]) continue;
+                ++path_checked;
+                int64_t id = trav_id(path[k]);
+                bool rev = trav_is_rev(path[k]);
+                size_t length = node_length(id);
+                // Every base of the step must map back to it. The offsets
+                // rank is the same at its first and last base exactly when
+                // that holds, so we needn't ask about each base.
+                bool ok = xgpath.members[node_rank_as_entity(id)-1]
+                    && xgpath.directions[k] == rev
+                    && xgpath.ids[k] == id
+                    && xgpath.positions[k] == starts[k]
+                    && (length == 0
+                        || (xgpath.offsets[starts[k]]
+                            && xgpath.offsets_rank(starts[k]+1) == k+1
+                            && xgpath.offsets_rank(starts[k]+length) == k+1));
+                if (!ok) {
+                    fail("step " + to_string(k) + " of path " + name + " on node " + to_string(id) + " does not match");
                 }
-                pos += n.sequence().size();
-                ++in_path;
             }
-            //cerr << path_name << " rank = " << prank << endl;
-            // check membership now for each entity in the path
+            entities_checked += path_checked;
+        });
+
+        if (failures > 0) {
+            cerr << "[xg] error: graph validation found " << failures << " problems" << endl;
+            exit(1);
+        }
+        if (entities_checked < entities_seen) {
+            // With no failures among n random checks, the rule of three says
+            // the true failure rate is under 3/n with 95% confidence.
+            cerr << "checked " << entities_checked << " of " << entities_seen
+                 << " nodes, edges and path steps; with 95% confidence, fewer than ";
+            if (entities_checked == 0) {
+                cerr << "100";
+            } else {
+                cerr << min(100.0, 300.0 / entities_checked);
+            }
+            cerr << "% of them are bad" << endl;
         }
         
-#if GPBWT_MODE == MODE_SDSL
-        if(store_threads && is_sorted_dag) {
-#elif GPBWT_MODE == MODE_DYNAMIC
         if(store_threads) {
-#endif
         
             cerr << "validating threads" << endl;
             
@@ -1163,18 +2675,18 @@ void XG::build(map<id_t, string>& node_label,
                 threads_found++;
             }
             
-            for (auto& pathpair : path_nodes) {
+            buffer.for_each_path([&](const string& name, const vector<trav_t>& path) {
                 Path reconstructed;
                 
                 // Grab the name
-                reconstructed.set_name(pathpair.first);
+                reconstructed.set_name(name);
                 
                 // This path should have been inserted. Look for it.
                 assert(count_matches(reconstructed) > 0);
                 
                 threads_expected += 2;
                 
-            }
+            });
             
             // Make sure we have the right number of threads.
             assert(threads_found == threads_expected);
@@ -1184,6 +2696,127 @@ void XG::build(map<id_t, string>& node_label,
     }
 }
 
+void XG::index_entity_paths(size_t entity_count) {
+    // Count the paths each entity is on, visiting only the members of each
+    // path rather than every entity for every path.
+    vector<uint32_t> entity_path_count(entity_count, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t j = 0; j < paths.size(); ++j) {
+        const XGPath& path = *paths[j];
+        size_t member_count = path.members_rank(path.members.size());
+        for (size_t k = 1; k <= member_count; ++k) {
+            size_t i = path.members_select(k);
+#pragma omp atomic
+            ++entity_path_count[i];
+        }
+    }
+
+    // Lay out a delimiter for each entity, followed by room for its paths.
+    size_t ep_size = entity_count;
+    for (auto count : entity_path_count) {
+        ep_size += count;
+    }
+    util::assign(ep_bv, bit_vector(ep_size));
+    size_t ep_off = 0;
+    for (size_t i = 0; i < entity_count; ++i) {
+        ep_bv[ep_off] = 1;
+        ep_off += 1 + entity_path_count[i];
+    }
+    util::assign(ep_bv_rank, rank_support_v<1>(&ep_bv));
+    util::assign(ep_bv_select, bit_vector::select_1_type(&ep_bv));
+
+    // Drop each path's rank into the slots of its members, filling each
+    // entity's slots from the back. Delimiters stay 0, so we can detect
+    // entities with no path membership.
+    vector<uint32_t> entity_paths(ep_size, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t j = 0; j < paths.size(); ++j) {
+        const XGPath& path = *paths[j];
+        size_t member_count = path.members_rank(path.members.size());
+        for (size_t k = 1; k <= member_count; ++k) {
+            size_t i = path.members_select(k);
+            uint32_t remaining;
+#pragma omp atomic capture
+            remaining = --entity_path_count[i];
+            entity_paths[ep_bv_select(i+1) + 1 + remaining] = j+1;
+        }
+    }
+
+    // Paths must be listed in rank order for each entity.
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (size_t i = 0; i < entity_count; ++i) {
+        size_t start = ep_bv_select(i+1) + 1;
+        size_t end = i+1 < entity_count ? ep_bv_select(i+2) : ep_size;
+        std::sort(entity_paths.begin() + start, entity_paths.begin() + end);
+    }
+
+    util::assign(ep_iv, int_vector<>(ep_size, 0, bits_needed(paths.size())));
+    for (size_t i = 0; i < ep_size; ++i) {
+        ep_iv[i] = entity_paths[i];
+    }
+    util::bit_compress(ep_iv);
+}
+
+// Each byte of s_iv holds four bases, lowest bits first. This gives their
+// letters, so we can decode a byte at a time.
+static const vector<array<char, 4>> base_quads = []() {
+    vector<array<char, 4>> quads(256);
+    for (size_t byte = 0; byte < 256; ++byte) {
+        for (size_t k = 0; k < 4; ++k) {
+            quads[byte][k] = revdna3bit((byte >> (2 * k)) & 3);
+        }
+    }
+    return quads;
+}();
+
+void XG::decode_sequence(size_t start, size_t end, char* out) const {
+    size_t i = start;
+    // Go a base at a time up to a byte boundary, then a byte at a time.
+    for (; i < end && i % 4 != 0; ++i) {
+        out[i - start] = revdna3bit(s_iv[i]);
+    }
+    const uint8_t* bytes = (const uint8_t*) s_iv.data();
+    for (; i + 4 <= end; i += 4) {
+        memcpy(out + i - start, base_quads[bytes[i / 4]].data(), 4);
+    }
+    for (; i < end; ++i) {
+        out[i - start] = revdna3bit(s_iv[i]);
+    }
+    // Then put the Ns back. The N vector ends at the last N, if any.
+    if (sn_sdv.size() == 0) return;
+    size_t first = sn_sdv_rank(min(start, (size_t) sn_sdv.size()));
+    size_t past_last = sn_sdv_rank(min(end, (size_t) sn_sdv.size()));
+    for (size_t k = first + 1; k <= past_last; ++k) {
+        out[sn_sdv_select(k) - start] = 'N';
+    }
+}
+
+char XG::base_at(size_t pos) const {
+    if (pos < sn_sdv.size() && sn_sdv[pos]) {
+        return 'N';
+    }
+    return revdna3bit(s_iv[pos]);
+}
+
+void XG::index_n_positions(const vector<uint64_t>& positions) {
+    util::assign(sn_sdv, sd_vector<>(positions.begin(), positions.end()));
+    util::assign(sn_sdv_rank, sd_vector<>::rank_1_type(&sn_sdv));
+    util::assign(sn_sdv_select, sd_vector<>::select_1_type(&sn_sdv));
+}
+
+void XG::pack_sequence(const int_vector<>& bases_3bit) {
+    util::assign(s_iv, int_vector<2>(bases_3bit.size(), 0));
+    vector<uint64_t> n_positions;
+    for (size_t i = 0; i < bases_3bit.size(); ++i) {
+        if (bases_3bit[i] > 3) {
+            n_positions.push_back(i);
+        } else {
+            s_iv[i] = bases_3bit[i];
+        }
+    }
+    index_n_positions(n_positions);
+}
+
 const uint64_t* XG::sequence_data(void) const {
     return s_iv.data();
 }
@@ -1200,82 +2833,212 @@ Node XG::node(int64_t id) const {
     return n;
 }
 
-string XG::node_sequence(int64_t id) const {
-    size_t rank = id_to_rank(id);
-    assert(rank != 0); // We can crash if we try to look up rank 0.
-    size_t start = s_cbv_select(rank);
-    size_t end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
-    string s; s.resize(end-start);
-    for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-        s[i-start] = revdna3bit(s_iv[i]);
+string XG::node_sequence(int64_t id) const {
+    return node_view(id).str();
+}
+
+XG::SequenceView XG::node_view(int64_t id, bool is_rev) const {
+    size_t rank = id_to_rank(id);
+    assert(rank != 0); // We can crash if we try to look up rank 0.
+    size_t start = rank_start(rank);
+    return SequenceView(this, start, rank_end(rank) - start, is_rev);
+}
+
+size_t XG::node_length(int64_t id) const {
+    size_t rank = id_to_rank(id);
+    return rank_end(rank) - rank_start(rank);
+}
+
+size_t XG::rank_start(size_t rank) const {
+    if (!node_starts.empty()) {
+        return node_starts[rank - 1];
+    }
+    return s_cbv_select(rank);
+}
+
+size_t XG::rank_end(size_t rank) const {
+    if (!node_starts.empty()) {
+        return node_starts[rank];
+    }
+    return rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
+}
+
+void XG::index_node_starts(void) {
+    size_t count = max_node_rank();
+    int_vector<> starts(count + 1);
+    for (size_t rank = 1; rank <= count; ++rank) {
+        starts[rank - 1] = s_cbv_select(rank);
+    }
+    starts[count] = s_cbv.size();
+    util::bit_compress(starts);
+    util::assign(node_starts, starts);
+}
+
+void XG::build_sequence_index(void) {
+    if (s_iv.size() == 0) {
+        return;
+    }
+    // Delimit the nodes, so that no match can span two of them
+    string labels;
+    labels.reserve(s_iv.size() + node_count);
+    // Mark the starts over the whole text, so we can rank anywhere in it.
+    bit_vector label_starts(s_iv.size() + node_count);
+    for (size_t i = 0; i < s_iv.size(); ++i) {
+        if (s_bv[i]) {
+            if (i != 0) {
+                labels.push_back(SEQUENCE_DELIMITER);
+            }
+            label_starts[labels.size()] = 1;
+        }
+        labels.push_back(base_at(i));
+    }
+    labels.push_back(SEQUENCE_DELIMITER);
+    util::assign(sl_sdv, sd_vector<>(label_starts));
+    util::assign(sl_sdv_rank, sd_vector<>::rank_1_type(&sl_sdv));
+    util::assign(sl_sdv_select, sd_vector<>::select_1_type(&sl_sdv));
+#pragma omp critical (construct_im)
+    construct_im(s_csa, labels, 1);
+}
+
+bool XG::has_sequence_index(void) const {
+    return sl_sdv.size() > 0;
+}
+
+pair<size_t, size_t> XG::sequence_range(const string& pattern) const {
+    if (!has_sequence_index()) {
+        return make_pair(1, 0);
     }
-    return s;
+    pair<size_t, size_t> range(0, s_csa.size() - 1);
+    for (auto it = pattern.rbegin(); it != pattern.rend() && range.first <= range.second; ++it) {
+        range = extend_sequence_range(range, *it);
+    }
+    return range;
 }
 
-size_t XG::node_length(int64_t id) const {
-    size_t rank = id_to_rank(id);
-    size_t start = s_cbv_select(rank);
-    size_t end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
-    return end-start;
+pair<size_t, size_t> XG::extend_sequence_range(const pair<size_t, size_t>& range, char base) const {
+    // The delimiter only separates nodes, and matching it would let a pattern
+    // span two of them.
+    if (!has_sequence_index() || range.first > range.second || base == SEQUENCE_DELIMITER) {
+        return make_pair(1, 0);
+    }
+    uint64_t first = 0;
+    uint64_t last = 0;
+    backward_search(s_csa, range.first, range.second, base, first, last);
+    return make_pair(first, last);
+}
+
+vector<pair<int64_t, size_t>> XG::locate_sequence(const pair<size_t, size_t>& range) const {
+    vector<pair<int64_t, size_t>> found;
+    for (size_t row = range.first; row <= range.second; ++row) {
+        size_t pos = s_csa[row];
+        if (pos >= sl_sdv.size()) {
+            // The end of the text, which only an empty pattern finds
+            continue;
+        }
+        size_t rank = sl_sdv_rank(pos + 1);
+        found.push_back(make_pair(rank_to_id(rank), pos - sl_sdv_select(rank)));
+    }
+    return found;
+}
+
+vector<pair<int64_t, size_t>> XG::locate_sequence(const string& pattern) const {
+    return locate_sequence(sequence_range(pattern));
 }
 
 char XG::pos_char(int64_t id, bool is_rev, size_t off) const {
     assert(off < node_length(id));
     if (!is_rev) {
         size_t rank = id_to_rank(id);
-        size_t pos = s_cbv_select(rank) + off;
+        size_t pos = rank_start(rank) + off;
         assert(pos < s_iv.size());
-        char c = revdna3bit(s_iv[pos]);
+        char c = base_at(pos);
         return c;
     } else {
         size_t rank = id_to_rank(id);
-        size_t pos = s_cbv_select(rank+1) - (off+1);
+        size_t pos = rank_end(rank) - (off+1);
         assert(pos < s_iv.size());
-        char c = revdna3bit(s_iv[pos]);
+        char c = base_at(pos);
         return reverse_complement(c);
     }
 }
 
 string XG::pos_substr(int64_t id, bool is_rev, size_t off, size_t len) const {
+    return pos_view(id, is_rev, off, len).str();
+}
+
+XG::SequenceView XG::pos_view(int64_t id, bool is_rev, size_t off, size_t len) const {
+    size_t rank = id_to_rank(id);
+    size_t node_start = rank_start(rank);
+    size_t node_end = rank_end(rank);
     if (!is_rev) {
-        size_t rank = id_to_rank(id);
-        size_t start = s_cbv_select(rank) + off;
+        size_t start = node_start + off;
         assert(start < s_iv.size());
         // get until the end position, or the end of the node, which ever is first
         size_t end;
         if (!len) {
-            end = s_cbv_select(rank+1);
+            end = node_end;
         } else {
-            end = min(start + len, (size_t)s_cbv_select(rank+1));
-        }
-        assert(end < s_iv.size());
-        string s; s.resize(end-start);
-        for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-            s[i-start] = revdna3bit(s_iv[i]);
+            end = min(start + len, node_end);
         }
-        return s;
+        return SequenceView(this, start, end - start, false);
     } else {
-        size_t rank = id_to_rank(id);
-        size_t end = s_cbv_select(rank+1) - off;
-        assert(end < s_iv.size());
+        size_t end = node_end - off;
+        assert(end <= s_iv.size());
         // get until the end position, or the end of the node, which ever is first
         size_t start;
         if (len > end || !len) {
-            start = s_cbv_select(rank);
+            start = node_start;
         } else {
-            start = max(end - len, (size_t)s_cbv_select(rank));
+            start = max(end - len, node_start);
         }
-        assert(end < s_iv.size());
-        string s; s.resize(end-start);
-        for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-            s[i-start] = revdna3bit(s_iv[i]);
+        return SequenceView(this, start, end - start, true);
+    }
+}
+
+char XG::SequenceView::const_iterator::operator*(void) const {
+    if (!is_reverse) {
+        return graph->base_at(origin + index);
+    }
+    return xg::reverse_complement(graph->base_at(origin - index));
+}
+
+XG::SequenceView::const_iterator XG::SequenceView::begin(void) const {
+    return const_iterator(graph, is_reverse ? start + length - 1 : start, is_reverse, 0);
+}
+
+XG::SequenceView XG::SequenceView::reverse_complement(void) const {
+    return SequenceView(graph, start, length, !is_reverse);
+}
+
+XG::SequenceView XG::SequenceView::substr(size_t off, size_t len) const {
+    off = min(off, length);
+    len = min(len, length - off);
+    // Offsets count from the end of the bases on the reverse strand.
+    return SequenceView(graph, is_reverse ? start + length - off - len : start + off, len, is_reverse);
+}
+
+void XG::SequenceView::copy_to(char* out) const {
+    graph->decode_sequence(start, start + length, out);
+    if (is_reverse) {
+        std::reverse(out, out + length);
+        for (size_t i = 0; i < length; ++i) {
+            out[i] = xg::reverse_complement(out[i]);
         }
-        return reverse_complement(s);
     }
 }
 
+string XG::SequenceView::str(void) const {
+    string s(length, '\0');
+    copy_to(&s[0]);
+    return s;
+}
+
 size_t XG::id_to_rank(int64_t id) const {
-    return r_iv[id-min_id];
+    if (!sparse_ids) {
+        return r_iv[id-min_id];
+    }
+    size_t offset = id - min_id;
+    return r_sdv[offset] ? r_sdv_rank(offset) + 1 : 0;
 }
 
 int64_t XG::rank_to_id(size_t rank) const {
@@ -1302,21 +3065,21 @@ Edge XG::edge_for_entity(size_t rank) const {
 }
 
 vector<Edge> XG::edges_of(int64_t id) const {
-    auto e1 = edges_to(id);
-    auto e2 = edges_from(id);
-    e1.reserve(e1.size() + distance(e2.begin(), e2.end()));
-    e1.insert(e1.end(), e2.begin(), e2.end());
-    // now get rid of duplicates
-    vector<Edge> e3;
-    set<string> seen;
-    for (auto& edge : e1) {
-        string s; edge.SerializeToString(&s);
-        if (!seen.count(s)) {
-            e3.push_back(edge);
-            seen.insert(s);
-        }
+    vector<Edge> edges = edges_to(id);
+    size_t rank = id_to_rank(id);
+    size_t f_start = f_bv_select(rank)+1;
+    size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
+    for (size_t i = f_start; i < f_end; ++i) {
+        // Self loops are in both tables, and we already have them.
+        if (f_iv[i] == rank) continue;
+        Edge edge;
+        edge.set_from(id);
+        edge.set_to(rank_to_id(f_iv[i]));
+        edge.set_from_start(f_from_start_cbv[i]);
+        edge.set_to_end(f_to_end_cbv[i]);
+        edges.push_back(edge);
     }
-    return e3;
+    return edges;
 }
 
 vector<Edge> XG::edges_to(int64_t id) const {
@@ -1352,6 +3115,9 @@ vector<Edge> XG::edges_from(int64_t id) const {
 }
 
 vector<Edge> XG::edges_on_start(int64_t id) const {
+    if (!sa_offsets.empty()) {
+        return side_edges(id, true);
+    }
     vector<Edge> edges;
     for (auto& edge : edges_of(id)) {
         if((edge.to() == id && !edge.to_end()) || (edge.from() == id && edge.from_start())) {
@@ -1362,6 +3128,9 @@ vector<Edge> XG::edges_on_start(int64_t id) const {
 }
 
 vector<Edge> XG::edges_on_end(int64_t id) const {
+    if (!sa_offsets.empty()) {
+        return side_edges(id, false);
+    }
     vector<Edge> edges;
     for (auto& edge : edges_of(id)) {
         if((edge.to() == id && edge.to_end()) || (edge.from() == id && !edge.from_start())) {
@@ -1371,19 +3140,158 @@ vector<Edge> XG::edges_on_end(int64_t id) const {
     return edges;
 }
 
+handle_t XG::get_handle(int64_t id, bool is_reverse) const {
+    return handle_t{(uint64_t) id_to_rank(id) << 1 | is_reverse};
+}
+
+int64_t XG::get_id(const handle_t& handle) const {
+    return rank_to_id(handle.packed >> 1);
+}
+
+bool XG::get_is_reverse(const handle_t& handle) const {
+    return handle.packed & 1;
+}
+
+handle_t XG::flip(const handle_t& handle) const {
+    return handle_t{handle.packed ^ 1};
+}
+
+size_t XG::get_length(const handle_t& handle) const {
+    size_t rank = handle.packed >> 1;
+    return rank_end(rank) - rank_start(rank);
+}
+
+bool XG::follow_edges(const handle_t& handle, bool go_left,
+                      const function<bool(const handle_t&)>& iteratee) const {
+    size_t rank = handle.packed >> 1;
+    // Which side of the node we leave from
+    bool leave_start = get_is_reverse(handle) != go_left;
+    // We find the handles in the orientation we would walk them in. Going
+    // left, we give them in the orientation that reads into this handle.
+    if (!sa_offsets.empty()) {
+        size_t side = (rank - 1) * 2 + !leave_start;
+        for (size_t i = sa_offsets[side]; i < sa_offsets[side + 1]; ++i) {
+            if (!iteratee(handle_t{(sa_iv[i] >> 1) ^ go_left})) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return for_each_table_edge(rank, leave_start, [&](const handle_t& next, bool from_here) {
+        return iteratee(go_left ? flip(next) : next);
+    });
+}
+
+bool XG::for_each_table_edge(size_t rank, bool leave_start,
+                             const function<bool(const handle_t&, bool)>& fn) const {
+    // We go in the order edges_of lists edges, since the B_s arrays number
+    // each side's edges that way: the reverse table, and then the forward
+    // table without the self loops already in the reverse one.
+    // Edges to the node arrive on its end if to_end. We arrive on the start
+    // of the other node, and so read it forward, if from_start.
+    size_t t_start = t_bv_select(rank)+1;
+    size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank+1);
+    for (size_t i = t_start; i < t_end; ++i) {
+        bool from_start = t_from_start_cbv[i];
+        bool to_end = t_to_end_cbv[i];
+        if (to_end != leave_start) {
+            if (!fn(handle_t{(uint64_t) t_iv[i] << 1 | !from_start}, false)) {
+                return false;
+            }
+        } else if (t_iv[i] == rank && from_start == leave_start) {
+            // A self loop leaving from this side, along the edge
+            if (!fn(handle_t{(uint64_t) rank << 1 | to_end}, true)) {
+                return false;
+            }
+        }
+    }
+    // Edges from the node leave from its start if from_start. We arrive on
+    // the end of the other node, and so read it in reverse, if to_end.
+    size_t f_start = f_bv_select(rank)+1;
+    size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
+    for (size_t i = f_start; i < f_end; ++i) {
+        if (f_iv[i] != rank && f_from_start_cbv[i] == leave_start
+            && !fn(handle_t{(uint64_t) f_iv[i] << 1 | f_to_end_cbv[i]}, true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void XG::index_side_adjacency(void) {
+    // Count the edges on each side first, so we can lay them out in place.
+    util::assign(sa_offsets, int_vector<>(node_count * 2 + 1, 0, bits_needed(f_iv.size() * 2)));
+    size_t total = 0;
+    for (size_t side = 0; side < node_count * 2; ++side) {
+        sa_offsets[side] = total;
+        for_each_table_edge(side / 2 + 1, side % 2 == 0, [&](const handle_t& next, bool from_here) {
+            ++total;
+            return true;
+        });
+    }
+    sa_offsets[node_count * 2] = total;
+    util::assign(sa_iv, int_vector<>(total, 0, bits_needed(node_count << 2 | 3)));
+    size_t i = 0;
+    for (size_t side = 0; side < node_count * 2; ++side) {
+        for_each_table_edge(side / 2 + 1, side % 2 == 0, [&](const handle_t& next, bool from_here) {
+            sa_iv[i++] = next.packed << 1 | from_here;
+            return true;
+        });
+    }
+}
+
+vector<Edge> XG::side_edges(int64_t id, bool on_start) const {
+    vector<Edge> edges;
+    size_t side = (id_to_rank(id) - 1) * 2 + !on_start;
+    for (size_t i = sa_offsets[side]; i < sa_offsets[side + 1]; ++i) {
+        uint64_t entry = sa_iv[i];
+        int64_t other = rank_to_id(entry >> 2);
+        bool other_rev = entry >> 1 & 1;
+        // Put the edge back the way the tables store it
+        if (entry & 1) {
+            edges.push_back(make_edge(id, on_start, other, other_rev));
+        } else {
+            edges.push_back(make_edge(other, !other_rev, id, !on_start));
+        }
+    }
+    return edges;
+}
+
+size_t XG::degree(const handle_t& handle, bool go_left) const {
+    if (!sa_offsets.empty()) {
+        size_t side = ((handle.packed >> 1) - 1) * 2 + (get_is_reverse(handle) == go_left);
+        return sa_offsets[side + 1] - sa_offsets[side];
+    }
+    size_t count = 0;
+    follow_edges(handle, go_left, [&](const handle_t& next) {
+        ++count;
+        return true;
+    });
+    return count;
+}
+
 size_t XG::max_node_rank(void) const {
     return s_cbv_rank(s_cbv.size());
 }
 
+int64_t XG::min_node_id(void) const {
+    return min_id;
+}
+
+int64_t XG::max_node_id(void) const {
+    return max_id;
+}
+
 int64_t XG::node_at_seq_pos(size_t pos) const {
     return rank_to_id(s_cbv_rank(pos));
 }
 
 size_t XG::node_start(int64_t id) const {
-    return s_cbv_select(id_to_rank(id));
+    return rank_start(id_to_rank(id));
 }
 
 size_t XG::max_path_rank(void) const {
+    ensure_paths();
     //cerr << pn_bv << endl;
     //cerr << "..." << pn_bv_rank(pn_bv.size()) << endl;
     return pn_bv_rank(pn_bv.size());
@@ -1484,6 +3392,7 @@ Edge XG::canonicalize(const Edge& edge) const {
 }
 
 Path XG::path(const string& name) const {
+    ensure_paths();
     // Extract a whole path by name
     
     // First find the XGPath we're using to store it.
@@ -1512,8 +3421,48 @@ Path XG::path(const string& name) const {
     
 }
 
+int XG::compare_path_name(size_t rank, const string& name) const {
+    ensure_paths();
+    size_t start = pn_bv_select(rank)+1; // step past '#'
+    size_t end = rank == path_count ? pn_iv.size() : pn_bv_select(rank+1);
+    end -= 1;  // step before '$'
+    // Compare as unsigned chars, like string::compare does
+    for (size_t i = start, j = 0; ; ++i, ++j) {
+        if (i == end) {
+            return j == name.size() ? 0 : -1;
+        }
+        if (j == name.size()) {
+            return 1;
+        }
+        unsigned char ours = (char) pn_iv[i];
+        unsigned char theirs = name[j];
+        if (ours != theirs) {
+            return ours < theirs ? -1 : 1;
+        }
+    }
+}
+
 size_t XG::path_rank(const string& name) const {
-    // find the name in the csa
+    ensure_paths();
+    // Paths are stored in name order, so we can usually find the name by
+    // binary search over the names themselves, which is much cheaper than a
+    // locate in the csa when there are many paths.
+    size_t low = 1;
+    size_t high = path_count + 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int comparison = compare_path_name(mid, name);
+        if (comparison == 0) {
+            return mid;
+        } else if (comparison < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    // The name could still be here if the names are not in order, so fall
+    // back to finding the name in the csa
     string query = start_marker + name + end_marker;
     auto occs = locate(pn_csa, query);
     if (occs.size() > 1) {
@@ -1530,6 +3479,7 @@ size_t XG::path_rank(const string& name) const {
 }
 
 string XG::path_name(size_t rank) const {
+    ensure_paths();
     size_t start = pn_bv_select(rank)+1; // step past '#'
     size_t end = rank == path_count ? pn_iv.size() : pn_bv_select(rank+1);
     end -= 1;  // step before '$'
@@ -1541,6 +3491,7 @@ string XG::path_name(size_t rank) const {
 }
 
 bool XG::path_contains_entity(const string& name, size_t rank) const {
+    ensure_paths();
     return 1 == paths[path_rank(name)-1]->members[rank-1];
 }
 
@@ -1553,6 +3504,7 @@ bool XG::path_contains_edge(const string& name, int64_t id1, bool from_start, in
 }
 
 vector<size_t> XG::paths_of_entity(size_t rank) const {
+    ensure_paths();
     size_t off = ep_bv_select(rank);
     assert(ep_bv[off++]);
     vector<size_t> path_ranks;
@@ -1567,6 +3519,7 @@ vector<size_t> XG::paths_of_node(int64_t id) const {
 }
     
 vector<pair<size_t, bool>> XG::paths_of_node_traversal(int64_t id, bool is_rev) const {
+    ensure_paths();
     vector<pair<size_t, bool>> path_orientations;
     for (size_t path_rank : paths_of_node(id)) {
         bool forward = false;
@@ -1592,6 +3545,7 @@ vector<size_t> XG::paths_of_edge(int64_t id1, bool from_start, int64_t id2, bool
 }
 
 map<string, vector<Mapping>> XG::node_mappings(int64_t id) const {
+    ensure_paths();
     map<string, vector<Mapping>> mappings;
     // for each time the node crosses the path
     for (auto i : paths_of_entity(node_rank_as_entity(id))) {
@@ -1625,6 +3579,7 @@ void XG::expand_context(Graph& g, size_t dist, bool add_paths, bool use_steps,
 void XG::expand_context_by_steps(Graph& g, size_t steps, bool add_paths,
                                  bool expand_forward, bool expand_backward,
                                  int64_t until_node) const {
+    ensure_paths();
     map<int64_t, Node*> nodes;
     map<pair<side_t, side_t>, Edge*> edges;
     set<int64_t> to_visit;
@@ -1738,6 +3693,7 @@ void XG::expand_context_by_steps(Graph& g, size_t steps, bool add_paths,
 void XG::expand_context_by_length(Graph& g, size_t length, bool add_paths,
                                   bool expand_forward, bool expand_backward,
                                   int64_t until_node) const {
+    ensure_paths();
 
     // map node_id --> min-distance-to-left-side, min-distance-to-right-side
     // these distances include the length of the node in the table. 
@@ -1851,6 +3807,7 @@ void XG::expand_context_by_length(Graph& g, size_t length, bool add_paths,
 // otherwise... owch
 // the paths become disordered due to traversal of the node ids in order
 void XG::add_paths_to_graph(map<int64_t, Node*>& nodes, Graph& g) const {
+    ensure_paths();
     // map from path name to (map from mapping rank to mapping)
     map<string, map<size_t, Mapping>> paths;
     // mappings without 
@@ -1922,7 +3879,7 @@ void XG::get_id_range(int64_t id1, int64_t id2, Graph& g) const {
 void XG::get_id_range_by_length(int64_t id, int64_t length, Graph& g, bool forward) const {
     // find out first base of node's position in the sequence vector
     size_t rank = id_to_rank(id);
-    size_t start = s_cbv_select(rank);
+    size_t start = rank_start(rank);
     size_t end;
     // jump by length, checking to make sure we stay in bounds
     if (forward) {
@@ -1947,10 +3904,12 @@ void XG::get_connected_nodes(Graph& g) {
 */
 
 size_t XG::path_length(const string& name) const {
+    ensure_paths();
     return paths[path_rank(name)-1]->offsets.size();
 }
 
 size_t XG::path_length(size_t rank) const {
+    ensure_paths();
     return paths[rank-1]->offsets.size();
 }
 
@@ -1983,6 +3942,7 @@ pair<int64_t, vector<size_t> > XG::nearest_path_node(int64_t id, int max_steps)
 // if node is on path, return it.  otherwise, return next node (in id space)
 // that is on path.  if none exists, return 0
 int64_t XG::next_path_node_by_id(size_t path_rank, int64_t id) const {
+    ensure_paths();
 
     // find our node in the members bit vector of the xgpath
     const XGPath* path = paths[path_rank - 1];
@@ -2020,6 +3980,7 @@ int64_t XG::next_path_node_by_id(size_t path_rank, int64_t id) const {
 // if node is on path, return it.  otherwise, return previous node (in id space)
 // that is on path.  if none exists, return 0
 int64_t XG::prev_path_node_by_id(size_t path_rank, int64_t id) const {
+    ensure_paths();
 
     // find our node in the members bit vector of the xgpath
     XGPath* path = paths[path_rank - 1];
@@ -2061,6 +4022,7 @@ int64_t XG::prev_path_node_by_id(size_t path_rank, int64_t id) const {
 // pair consistency).
 // returns -1 if couldn't find distance
 int64_t XG::approx_path_distance(const string& name, int64_t id1, int64_t id2) const {
+    ensure_paths();
     // simplifying assumption: id1 lies before id2 on path (and id space)
     if (id1 > id2) {
         swap(id1, id2);
@@ -2097,6 +4059,7 @@ int64_t XG::approx_path_distance(const string& name, int64_t id1, int64_t id2) c
 // contain the nodes when possible. 
 int64_t XG::min_approx_path_distance(const vector<string>& names,
                                      int64_t id1, int64_t id2) const {
+    ensure_paths();
 
     int64_t min_distance = numeric_limits<int64_t>::max();
     pair<int64_t, vector<size_t> > near1 = nearest_path_node(id1);
@@ -2122,6 +4085,7 @@ int64_t XG::min_approx_path_distance(const vector<string>& names,
 int64_t XG::closest_shared_path_oriented_distance(int64_t id1, size_t offset1, bool rev1,
                                                   int64_t id2, size_t offset2, bool rev2,
                                                   size_t max_search_dist) const {
+    ensure_paths();
     
 #ifdef debug_algorithms
     cerr << "[XG] estimating oriented distance between " << id1 << "[" << offset1 << "]" << (rev1 ? "-" : "+") << " and " << id2 << "[" << offset2 << "]" << (rev2 ? "-" : "+") << " with max search distance of " << max_search_dist << endl;
@@ -2298,6 +4262,7 @@ int64_t XG::closest_shared_path_oriented_distance(int64_t id1, size_t offset1, b
 
 void XG::for_path_range(const string& name, int64_t start, int64_t stop,
                         function<void(int64_t)> lambda, bool is_rev) const {
+    ensure_paths();
 
     // what is the node at the start, and at the end
     auto& path = *paths[path_rank(name)-1];
@@ -2367,20 +4332,24 @@ void XG::get_path_range(const string& name, int64_t start, int64_t stop, Graph&
 }
 
 size_t XG::node_occs_in_path(int64_t id, const string& name) const {
+    ensure_paths();
     return node_occs_in_path(id, path_rank(name));
 }
 
 size_t XG::node_occs_in_path(int64_t id, size_t rank) const {
+    ensure_paths();
     size_t p = rank-1;
     auto& pi_wt = paths[p]->ids;
     return pi_wt.rank(pi_wt.size(), id);
 }
 
 vector<size_t> XG::node_ranks_in_path(int64_t id, const string& name) const {
+    ensure_paths();
     return node_ranks_in_path(id, path_rank(name));
 }
 
 vector<size_t> XG::node_ranks_in_path(int64_t id, size_t rank) const {
+    ensure_paths();
     vector<size_t> ranks;
     size_t p = rank-1;
     size_t occs = node_occs_in_path(id, rank);
@@ -2392,10 +4361,12 @@ vector<size_t> XG::node_ranks_in_path(int64_t id, size_t rank) const {
 }
 
 vector<size_t> XG::position_in_path(int64_t id, const string& name) const {
+    ensure_paths();
     return position_in_path(id, path_rank(name));
 }
 
 vector<size_t> XG::position_in_path(int64_t id, size_t rank) const {
+    ensure_paths();
     auto& path = *paths[rank-1];
     vector<size_t> pos_in_path;
     for (auto i : node_ranks_in_path(id, rank)) {
@@ -2405,6 +4376,7 @@ vector<size_t> XG::position_in_path(int64_t id, size_t rank) const {
 }
 
 map<string, vector<size_t> > XG::position_in_paths(int64_t id, bool is_rev, size_t offset) const {
+    ensure_paths();
     map<string, vector<size_t> > positions;
     for (auto& prank : paths_of_node(id)) {
         auto& path = *paths[prank-1];
@@ -2459,16 +4431,19 @@ int XG::min_distance_in_paths(int64_t id1, bool is_rev1, size_t offset1,
 }
 
 int64_t XG::node_at_path_position(const string& name, size_t pos) const {
+    ensure_paths();
     size_t p = path_rank(name)-1;
     return paths[p]->ids[paths[p]->offsets_rank(pos+1)-1];
 }
 
 Mapping XG::mapping_at_path_position(const string& name, size_t pos) const {
+    ensure_paths();
     size_t p = path_rank(name)-1;
     return paths[p]->mapping(paths[p]->offsets_rank(pos+1)-1);
 }
 
 size_t XG::node_start_at_path_position(const string& name, size_t pos) const {
+    ensure_paths();
     size_t p = path_rank(name)-1;
     size_t position_rank = paths[p]->offsets_rank(pos+1);
     return paths[p]->offsets_select(position_rank);
@@ -2511,7 +4486,7 @@ void to_text(ostream& out, Graph& graph) {
     for (size_t i = 0; i < graph.path_size(); ++i) {
         auto& path = graph.path(i);
         for (size_t j = 0; j < path.mapping_size(); ++j) {
-            auto& mapping = path.mapping(i);
+            auto& mapping = path.mapping(j);
             string orientation = mapping.position().is_reverse() ? "-" : "+";
             out << "P" << "\t" << mapping.position().node_id() << "\t" << path.name() << "\t"
                 << mapping.rank() << "\t" << orientation << "\n";
@@ -2527,6 +4502,7 @@ void to_text(ostream& out, Graph& graph) {
 }
 
 int64_t XG::where_to(int64_t current_side, int64_t visit_offset, int64_t new_side) const {
+    ensure_threads();
     // Given that we were at visit_offset on the current side, where will we be
     // on the new side? 
     
@@ -2548,10 +4524,12 @@ int64_t XG::where_to(int64_t current_side, int64_t visit_offset, int64_t new_sid
 }
 
 int64_t XG::node_height(XG::ThreadMapping node) const {
+    ensure_threads();
   return h_iv[(node_rank_as_entity(node.node_id) - 1) * 2 + node.is_reverse];
 }
 
 int64_t XG::where_to(int64_t current_side, int64_t visit_offset, int64_t new_side, vector<Edge>& edges_into_new, vector<Edge>& edges_out_of_old) const {
+    ensure_threads();
     // Given that we were at visit_offset on the current side, where will we be
     // on the new side?
 
@@ -2641,6 +4619,7 @@ int64_t XG::where_to(int64_t current_side, int64_t visit_offset, int64_t new_sid
 }
 
 XG::thread_t XG::extract_thread(xg::XG::ThreadMapping node, int64_t offset = 0, int64_t max_length = 0) {
+  ensure_threads();
   thread_t path;
   int64_t side = (node.node_id)*2 + node.is_reverse;
   bool continue_search = true;
@@ -2685,6 +4664,7 @@ XG::thread_t XG::extract_thread(xg::XG::ThreadMapping node, int64_t offset = 0,
 }
 
 void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>& names) {
+    ensure_threads();
 
     // Store the names
     for (auto& name : names) {
@@ -2703,42 +4683,21 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
     int_vector<> tio_iv(t.size()*2+2);
     int thread_count = 0;
     
-    auto emit_destinations = [&](int64_t node_id, bool is_reverse, vector<size_t> destinations) {
+    auto emit_destinations = [&](size_t node_rank, bool is_reverse, const vector<size_t>& destinations) {
         // We have to take this destination vector and store it in whatever B_s
         // storage we are using.
         
-        int64_t node_side = id_to_rank(node_id) * 2 + is_reverse;
+        int64_t node_side = node_rank * 2 + is_reverse;
         
         // Copy all the destinations into the succinct B_s storage
         bs_set(node_side, destinations);
         
         // Set the number of total visits to this side.
-        h_iv[(node_rank_as_entity(node_id) - 1) * 2 + is_reverse] = destinations.size();
-    
-#ifdef VERBOSE_DEBUG
-        cerr << "Found " << destinations.size() << " visits total to node " << node_id << (is_reverse ? "-" : "+") << endl;
-#endif
-    };
+        h_iv[f_bv_select(node_rank) * 2 + is_reverse] = destinations.size();
     
-    auto emit_edge_traversal = [&](int64_t node_id, bool from_start, int64_t next_node_id, bool to_end) {
-        // We have to store the fact that we traversed this edge in the specified direction in our succinct storage. 
-        
-        // Find the edge as it actually appears in the graph.
-        Edge canonical = canonicalize(make_edge(node_id, from_start, next_node_id, to_end));
-        
-        // We're departing along this edge, so our orientation cares about
-        // whether we have to take the edge forward or backward when departing.
-        auto edge_rank = edge_rank_as_entity(canonical);
-        assert(edge_rank != numeric_limits<size_t>::max()); // We must actually have the edge
-        int64_t edge_orientation_number = (edge_rank - 1) * 2 +
-            depart_by_reverse(canonical, node_id, from_start);
-                
 #ifdef VERBOSE_DEBUG
-        cerr << "We need to add 1 to the traversals of oriented edge " << edge_orientation_number << endl;
+        cerr << "Found " << destinations.size() << " visits total to node " << rank_to_id(node_rank) << (is_reverse ? "-" : "+") << endl;
 #endif
-                
-        // Increment the count for the edge
-        h_iv[edge_orientation_number]++; 
     };
     
     auto emit_thread_start = [&](int64_t node_id, bool is_reverse) {
@@ -2761,45 +4720,193 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
         
     };
 
-    // We want to go through and insert running forward through the DAG, and
-    // then again backward through the DAG.
-    auto insert_in_direction = [&](bool insert_reverse) {
-
-        // First sort out the thread numbers by the node they start at.
-        // We know all the threads go the same direction through each node.
-        map<int64_t, list<size_t>> thread_numbers_by_start_node;
-        
+    // Sort out the thread numbers by the rank of the node they start at,
+    // running forward through the threads and then backward. We know all the
+    // threads go the same direction through each node. Starts are numbered in
+    // this order, so we do this up front before the passes through the graph.
+    // The threads starting at node rank r in a direction are
+    // start_threads[dir][start_bounds[dir][r]] up to start_bounds[dir][r+1].
+    vector<vector<size_t>> start_bounds(2, vector<size_t>(max_node_rank() + 2, 0));
+    vector<vector<size_t>> start_threads(2);
+    for (bool insert_reverse : {false, true}) {
+        auto& bounds = start_bounds[insert_reverse];
+        for(size_t i = 0; i < t.size(); i++) {
+            if(t[i].size() > 0) {
+                auto& mapping = t[i][insert_reverse ? t[i].size() - 1 : 0];
+                bounds[id_to_rank(mapping.node_id) + 1]++;
+            }
+        }
+        for(size_t rank = 1; rank < bounds.size(); rank++) {
+            bounds[rank] += bounds[rank - 1];
+        }
+        start_threads[insert_reverse].resize(bounds.back());
+        vector<size_t> filled(bounds.begin(), bounds.end() - 1);
         for(size_t i = 0; i < t.size(); i++) {
             if(t[i].size() > 0) {
                 // Do we start with the first or last mapping in the thread?
                 size_t thread_start = insert_reverse ? t[i].size() - 1 : 0;
                 auto& mapping = t[i][thread_start];
-                thread_numbers_by_start_node[mapping.node_id].push_back(i);
+                size_t rank = id_to_rank(mapping.node_id);
+                start_threads[insert_reverse][filled[rank]] = i;
                 // we know the mapping node id and rank
                 // so we can construct the start position for this entity
                 int k = 2*(i+1) + insert_reverse;
                 tin_iv[k] = mapping.node_id;
                 // nb: the rank of this thread among those starting at this side
-                tio_iv[k] = thread_numbers_by_start_node[mapping.node_id].size()-1;
+                tio_iv[k] = filled[rank] - bounds[rank];
+                filled[rank]++;
                 // Say a thread starts here, going in the orientation determined
                 // by how the node is visited and how we're traversing the path.
                 emit_thread_start(mapping.node_id, mapping.is_reverse != insert_reverse);
             }
         }
-        
+    }
+
+    // Threads never cross between weakly connected components, so each
+    // component can be swept on its own. Find them with a union-find over
+    // node ranks, following the forward edge table.
+    vector<size_t> component_root(max_node_rank() + 1);
+    for(size_t rank = 0; rank <= max_node_rank(); rank++) {
+        component_root[rank] = rank;
+    }
+    auto find_root = [&](size_t rank) {
+        while(component_root[rank] != rank) {
+            component_root[rank] = component_root[component_root[rank]];
+            rank = component_root[rank];
+        }
+        return rank;
+    };
+    size_t from_rank = 0;
+    for(size_t i = 0; i < f_iv.size(); i++) {
+        if(f_bv[i]) {
+            from_rank = f_iv[i];
+        } else {
+            size_t a = find_root(from_rank);
+            size_t b = find_root(f_iv[i]);
+            if(a != b) component_root[max(a, b)] = min(a, b);
+        }
+    }
+    // Number the components, and list each one's node ranks in order.
+    vector<size_t> component_number(max_node_rank() + 1, numeric_limits<size_t>::max());
+    vector<vector<size_t>> component_ranks;
+    for(size_t rank = 1; rank <= max_node_rank(); rank++) {
+        size_t root = find_root(rank);
+        if(component_number[root] == numeric_limits<size_t>::max()) {
+            component_number[root] = component_ranks.size();
+            component_ranks.emplace_back();
+        }
+        component_ranks[component_number[root]].push_back(rank);
+    }
+
+    // Only sweep components where threads start in that direction.
+    vector<pair<bool, size_t>> sweeps;
+    for (bool insert_reverse : {false, true}) {
+        set<size_t> started;
+        for(size_t rank = 1; rank <= max_node_rank(); rank++) {
+            if(start_bounds[insert_reverse][rank + 1] > start_bounds[insert_reverse][rank]) {
+                started.insert(component_number[find_root(rank)]);
+            }
+        }
+        for(auto component : started) {
+            sweeps.emplace_back(insert_reverse, component);
+        }
+    }
+    // Start the biggest sweeps first, so the small ones fill in around them.
+    std::stable_sort(sweeps.begin(), sweeps.end(), [&](const pair<bool, size_t>& a, const pair<bool, size_t>& b) {
+        return component_ranks[a.second].size() > component_ranks[b.second].size();
+    });
+
+    // Edges are identified by entity rank, which is one past their position
+    // in the forward edge table. For each entry in the reverse edge table,
+    // find the same edge's position in the forward table, so we can name the
+    // edges on a node straight from the tables.
+    vector<size_t> t_to_f(t_iv.size(), 0);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for(size_t rank = 1; rank <= max_node_rank(); rank++) {
+        size_t t_start = t_bv_select(rank) + 1;
+        size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank + 1);
+        for(size_t i = t_start; i < t_end; i++) {
+            size_t other = t_iv[i];
+            size_t f_start = f_bv_select(other) + 1;
+            size_t f_end = other == node_count ? f_bv.size() : f_bv_select(other + 1);
+            for(size_t j = f_start; j < f_end; j++) {
+                if(f_iv[j] == rank && f_from_start_cbv[j] == t_from_start_cbv[i]
+                   && f_to_end_cbv[j] == t_to_end_cbv[i]) {
+                    t_to_f[i] = j;
+                    break;
+                }
+            }
+        }
+    }
+
+    // An edge on a node, as seen from that node: where it leads when left
+    // from the node's departing side, and in which orientation it is crossed.
+    struct NodeEdge {
+        size_t edge_rank;
+        int64_t from;
+        bool from_start;
+        int64_t to;
+        bool to_end;
+    };
+    // Fill in the edges on a node in the order edges_of() gives them: edges
+    // into it, then edges out of it, without repeats.
+    auto get_node_edges = [&](size_t node_rank, int64_t node_id, vector<NodeEdge>& edges) {
+        edges.clear();
+        size_t t_start = t_bv_select(node_rank) + 1;
+        size_t t_end = node_rank == node_count ? t_bv.size() : t_bv_select(node_rank + 1);
+        for(size_t i = t_start; i < t_end; i++) {
+            edges.push_back({t_to_f[i] + 1, rank_to_id(t_iv[i]), (bool) t_from_start_cbv[i],
+                             node_id, (bool) t_to_end_cbv[i]});
+        }
+        size_t f_start = f_bv_select(node_rank) + 1;
+        size_t f_end = node_rank == node_count ? f_bv.size() : f_bv_select(node_rank + 1);
+        for(size_t j = f_start; j < f_end; j++) {
+            bool seen = false;
+            for(auto& edge : edges) {
+                seen = seen || edge.edge_rank == j + 1;
+            }
+            if(!seen) {
+                edges.push_back({j + 1, node_id, (bool) f_from_start_cbv[j],
+                                 rank_to_id(f_iv[j]), (bool) f_to_end_cbv[j]});
+            }
+        }
+    };
+
+    // Messages waiting on each edge, as a slot number plus one in the sweep's
+    // message pool, or 0 for none. Every edge is in exactly one component, so
+    // the sweeps in each direction can share one array.
+    vector<vector<size_t>> edge_message_slot(2, vector<size_t>(f_iv.size() + 1, 0));
+
+    // We want to go through and insert running forward through the DAG, and
+    // then again backward through the DAG. Each sweep writes only the sides
+    // it visits in its own direction, and h_iv entries for its own edge
+    // orientations, which are whole words since h_iv is not bit-compressed
+    // yet, so the sweeps can all run at once.
+    auto insert_in_direction = [&](bool insert_reverse, const vector<size_t>& ranks) {
         // We have this message-passing architecture, where we send groups of
-        // threads along edges to destination nodes. This records, by edge rank of
-        // the traversed edge (with 0 meaning starting there), the group of threads
-        // coming in along that edge, and the offset in each thread that the visit
-        // to the node is at. These are messages passed along the edge from the
+        // threads along edges to destination nodes. Each edge with messages on
+        // it has a slot in the pool, holding the group of threads coming in
+        // along that edge, and the offset in each thread that the visit to the
+        // node is at. These are messages passed along the edge from the
         // earlier node to the later node (since we know threads follow a DAG).
-        map<size_t, list<pair<size_t, size_t>>> edge_to_ordered_threads;
+        // Slots are recycled, keeping their memory, once their messages are
+        // delivered.
+        auto& message_slot = edge_message_slot[insert_reverse];
+        vector<vector<pair<size_t, size_t>>> message_pool;
+        vector<size_t> free_slots;
+
+        // Buffers reused from node to node
+        vector<pair<size_t, size_t>> threads_visiting;
+        vector<NodeEdge> node_edges;
+        // Outgoing edges: index in node_edges, the node and orientation they
+        // lead to, and whether they are departed along in reverse
+        vector<tuple<size_t, int64_t, bool, bool>> outgoing;
+        vector<size_t> destinations;
         
-        for(size_t node_rank = (insert_reverse ? max_node_rank() : 1);
-            node_rank != (insert_reverse ? 0 : max_node_rank() + 1);
-            node_rank += (insert_reverse ? -1 : 1)) {
+        for(size_t k = 0; k < ranks.size(); k++) {
             // Then we start at the first node in the DAG
             
+            size_t node_rank = ranks[insert_reverse ? ranks.size() - 1 - k : k];
             int64_t node_id = rank_to_id(node_rank);
             
 #ifdef VERBOSE_DEBUG
@@ -2811,31 +4918,31 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
             // We order the thread visits starting there, and then all the threads
             // coming in from other places, ordered by edge traversed.
             // Stores a pair of thread number and mapping index in the thread.
-            list<pair<size_t, size_t>> threads_visiting;
+            threads_visiting.clear();
             
-            if(thread_numbers_by_start_node.count(node_id)) {
-                // Grab the threads starting here
-                for(size_t thread_number : thread_numbers_by_start_node.at(node_id)) {
-                    // For every thread that starts here, say it visits here
-                    // with its first mapping (0 for forward inserts, last one
-                    // for reverse inserts).
-                    threads_visiting.emplace_back(thread_number, insert_reverse ? t[thread_number].size() - 1 : 0);
-                }
-                thread_numbers_by_start_node.erase(node_id);
+            for(size_t i = start_bounds[insert_reverse][node_rank]; i < start_bounds[insert_reverse][node_rank + 1]; i++) {
+                // For every thread that starts here, say it visits here
+                // with its first mapping (0 for forward inserts, last one
+                // for reverse inserts).
+                size_t thread_number = start_threads[insert_reverse][i];
+                threads_visiting.emplace_back(thread_number, insert_reverse ? t[thread_number].size() - 1 : 0);
             }
             
-            
-            for(Edge& in_edge : edges_of(node_id)) {
+            get_node_edges(node_rank, node_id, node_edges);
+            for(auto& in_edge : node_edges) {
                 // Look at all the edges on the node. Messages will only exist on
                 // the incoming ones.
-                auto edge_rank = edge_rank_as_entity(in_edge);
-                if(edge_to_ordered_threads.count(edge_rank)) {
+                size_t slot = message_slot[in_edge.edge_rank];
+                if(slot != 0) {
                     // We have messages coming along this edge on our start
                     
-                    // These threads come in next. Splice them in because they
-                    // already have the right mapping indices.
-                    threads_visiting.splice(threads_visiting.end(), edge_to_ordered_threads[edge_rank]);
-                    edge_to_ordered_threads.erase(edge_rank);
+                    // These threads come in next. They already have the right
+                    // mapping indices.
+                    auto& messages = message_pool[slot - 1];
+                    threads_visiting.insert(threads_visiting.end(), messages.begin(), messages.end());
+                    messages.clear();
+                    free_slots.push_back(slot - 1);
+                    message_slot[in_edge.edge_rank] = 0;
                 }
             }
             
@@ -2857,19 +4964,26 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
             // Now we have all the threads coming through this node, and we know
             // which way they are going.
 
-            // Make a map from outgoing edge rank to the B_s array number (0 for
-            // stop here, 1 reserved as a separator, and 2 through n corresponding
-            // to outgoing edges in order) for this node's outgoing side.
-            map<size_t, size_t> edge_rank_to_local_edge_number;
-            auto outgoing_edges = node_is_reverse ? edges_on_start(node_id) : edges_on_end(node_id);
-            for(size_t i = 0; i < outgoing_edges.size(); i++) {
-                size_t edge_rank = edge_rank_as_entity(outgoing_edges[i]);
-                edge_rank_to_local_edge_number[edge_rank] = i + 2;
+            // Find the edges on this node's outgoing side, in order. Their
+            // B_s array numbers are 2 through n (0 is for stop here, 1 is
+            // reserved as a separator).
+            outgoing.clear();
+            for(size_t i = 0; i < node_edges.size(); i++) {
+                auto& edge = node_edges[i];
+                if(edge.from == node_id && edge.from_start == node_is_reverse) {
+                    // We cross it forward
+                    outgoing.emplace_back(i, edge.to, edge.to_end, false);
+                } else if(edge.to == node_id && edge.to_end != node_is_reverse) {
+                    // We cross it backward, unless it's a reversing self loop,
+                    // which reads the same both ways.
+                    outgoing.emplace_back(i, edge.from, !edge.from_start,
+                                          !(edge.from == edge.to && edge.from_start != edge.to_end));
+                }
             }
             
-            // Make a vector we'll fill in with all the B array values (0 for stop,
-            // 2 + edge number for outgoing edge)
-            vector<size_t> destinations;
+            // Fill in all the B array values (0 for stop, 2 + edge number for
+            // outgoing edge)
+            destinations.clear();
             
             for(auto& visit : threads_visiting) {
                 // Now go through all the path visits, fill in the edge numbers (or 0
@@ -2887,22 +5001,36 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
                     int64_t next_node_id = next_mapping.node_id;
                     bool next_is_reverse = next_mapping.is_reverse != insert_reverse;
                     
-                    // Figure out the rank of the edge we need to take to get
-                    // there. Note that we need to make sure we can handle going
-                    // forward and backward over edges.
-                    Edge canonical = canonicalize(make_edge(node_id, node_is_reverse, next_node_id, next_is_reverse));
-                    size_t next_edge_rank = edge_rank_as_entity(canonical);
+                    // Find the edge we need to take to get there, which we
+                    // must actually have.
+                    size_t local_edge_number = 0;
+                    while(local_edge_number < outgoing.size()
+                          && (get<1>(outgoing[local_edge_number]) != next_node_id
+                              || get<2>(outgoing[local_edge_number]) != next_is_reverse)) {
+                        local_edge_number++;
+                    }
+                    assert(local_edge_number < outgoing.size());
+                    auto& taken = outgoing[local_edge_number];
+                    size_t next_edge_rank = node_edges[get<0>(taken)].edge_rank;
                     
-                    // Look up what local edge number that edge gets and say we follow it.
-                    destinations.push_back(edge_rank_to_local_edge_number.at(next_edge_rank));
+                    // Say we follow it.
+                    destinations.push_back(local_edge_number + 2);
                     
                     // Send the new mapping along the edge after all the other ones
                     // we've sent along the edge
-                    edge_to_ordered_threads[next_edge_rank].push_back(next_visit);
+                    if(message_slot[next_edge_rank] == 0) {
+                        if(free_slots.empty()) {
+                            free_slots.push_back(message_pool.size());
+                            message_pool.emplace_back();
+                        }
+                        message_slot[next_edge_rank] = free_slots.back() + 1;
+                        free_slots.pop_back();
+                    }
+                    message_pool[message_slot[next_edge_rank] - 1].push_back(next_visit);
                     
-                    // Say we traverse an edge going from this node in this
-                    // orientation to that node in that orientation.
-                    emit_edge_traversal(node_id, node_is_reverse, next_node_id, next_is_reverse);
+                    // Count the traversal of the edge in the orientation we
+                    // depart along it.
+                    h_iv[(next_edge_rank - 1) * 2 + get<3>(taken)]++;
                     
                 } else {
                     // This visit ends here
@@ -2920,7 +5048,7 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
             // Emit the destinations array for the node. Store it in whatever
             // sort of succinct storage we are using...
             // We need to send along the side (false for left, true for right)
-            emit_destinations(node_id, node_is_reverse, destinations);
+            emit_destinations(node_rank, node_is_reverse, destinations);
             
             // We repeat through all nodes until done.
         }
@@ -2931,20 +5059,213 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
     
     // Actually call the inserts
 #ifdef VERBOSE_DEBUG
-    cerr << "Inserting threads forwards..." << endl;
+    cerr << "Inserting threads in " << sweeps.size() << " component sweeps..." << endl;
 #endif
-    insert_in_direction(false);
+#pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i = 0; i < sweeps.size(); i++) {
+        insert_in_direction(sweeps[i].first, component_ranks[sweeps[i].second]);
+    }
+    
+    // Actually build the B_s arrays for rank and select.
 #ifdef VERBOSE_DEBUG
-    cerr << "Inserting threads backwards..." << endl;
+    cerr << "Creating final compressed array..." << endl;
 #endif
-    insert_in_direction(true);
+    bs_bake();
     
+    // compress the starts for the threads
+    util::assign(tin_civ, int_vector<>(tin_iv));
+    util::assign(tio_civ, int_vector<>(tio_iv));
+    util::bit_compress(sides_ordered_by_thread_id);
+    // and build up the side wt
+    construct_im(side_thread_wt, sides_ordered_by_thread_id);
+}
+
+// Stably sort items by a key less than key_limit, in linear time.
+static void counting_sort(const vector<size_t>& items, vector<size_t>& sorted, size_t key_limit,
+                          const function<size_t(size_t)>& key) {
+    vector<size_t> bucket_start(key_limit + 1, 0);
+    for (auto item : items) {
+        bucket_start[key(item) + 1]++;
+    }
+    for (size_t k = 1; k <= key_limit; ++k) {
+        bucket_start[k] += bucket_start[k - 1];
+    }
+    sorted.resize(items.size());
+    for (auto item : items) {
+        sorted[bucket_start[key(item)]++] = item;
+    }
+}
+
+void XG::insert_threads_into_graph(const vector<thread_t>& t, const vector<string>& names) {
+    ensure_threads();
+
+    // Store the names
+    for (auto& name : names) {
+        names_str.append("$" + name);
+    }
+#ifdef VERBOSE_DEBUG
+    cerr << "Compressing thread names..." << endl;
+#endif
+    tn_bake();
+
+    // Lay out all the visits, running forward along every thread and then
+    // backward along every thread, which is the order insert_threads_into_dag()
+    // numbers thread starts in. We call one pass along one thread a walk.
+    vector<int64_t> visit_side;
+    vector<size_t> visit_depth; // 0 for the first visit of a walk
+    size_t walk_count = 0;
+    size_t max_walk_length = 0;
+
+    // store the sides in order of their addition to the threads
+    int_vector<> sides_ordered_by_thread_id(t.size()*2); // fwd and reverse
+
+    // store the start+offset for each thread and its reverse complement
+    int_vector<> tin_iv(t.size()*2+2);
+    int_vector<> tio_iv(t.size()*2+2);
+
+    for (bool insert_reverse : {false, true}) {
+        for (size_t i = 0; i < t.size(); i++) {
+            if (t[i].empty()) continue;
+            for (size_t j = 0; j < t[i].size(); j++) {
+                auto& mapping = t[i][insert_reverse ? t[i].size() - 1 - j : j];
+                visit_side.push_back(id_rev_to_side(mapping.node_id, mapping.is_reverse != insert_reverse));
+                visit_depth.push_back(j);
+            }
+            // Record the start, ranking it among the starts on its side
+            int64_t start_side = visit_side[visit_side.size() - t[i].size()];
+            int k = 2*(i+1) + insert_reverse;
+            tin_iv[k] = rank_to_id(start_side / 2);
+            tio_iv[k] = ts_iv[start_side];
+            ts_iv[start_side]++;
+            sides_ordered_by_thread_id[walk_count] = start_side;
+            walk_count++;
+            max_walk_length = max(max_walk_length, t[i].size());
+        }
+    }
+    size_t visit_count = visit_side.size();
+
+    // Find the edge taken between two visited sides, as it appears in the graph.
+    auto edge_between = [&](int64_t from_side, int64_t to_side) {
+        Edge canonical = canonicalize(make_edge(rank_to_id(from_side / 2), from_side % 2,
+                                                rank_to_id(to_side / 2), to_side % 2));
+        if (edge_rank_as_entity(canonical) == numeric_limits<size_t>::max()) {
+            cerr << "[xg] error: thread takes edge " << canonical.from() << (canonical.from_start() ? "L" : "R")
+                 << "-" << canonical.to() << (canonical.to_end() ? "R" : "L") << " which does not exist" << endl;
+            exit(1);
+        }
+        return canonical;
+    };
+    // Get the ranks of the edges into or out of a side, in the order where_to()
+    // and the B_s arrays number them.
+    auto side_edge_ranks = [&](int64_t side, bool incoming) {
+        int64_t node_id = rank_to_id(side / 2);
+        bool use_start = (side % 2) != incoming;
+        vector<size_t> ranks;
+        for (auto& edge : use_start ? edges_on_start(node_id) : edges_on_end(node_id)) {
+            ranks.push_back(edge_rank_as_entity(edge));
+        }
+        return ranks;
+    };
+    auto local_edge_number = [&](const vector<size_t>& ranks, size_t edge_rank) {
+        return (size_t) (find(ranks.begin(), ranks.end(), edge_rank) - ranks.begin());
+    };
+
+    vector<size_t> all_visits(visit_count);
+    for (size_t v = 0; v < visit_count; v++) {
+        all_visits[v] = v;
+    }
+    size_t side_limit = (max_node_rank() + 1) * 2;
+    vector<size_t> by_side;
+    counting_sort(all_visits, by_side, side_limit, [&](size_t v) { return visit_side[v]; });
+
+    // Each side's visits are ordered with the threads starting there first, in
+    // start order, and then by the edge they arrived on, and then by the order
+    // of their previous visits on the side they came from. That is, they are
+    // sorted by the sequence of edges taken to reach them, read backward and
+    // ending with the start. Give every visit a symbol for the step that
+    // reached it: its walk number if it starts there, or the local number of
+    // the edge it arrived by, after all the walk numbers.
+    vector<size_t> rank(visit_count);
+    size_t symbol_limit = walk_count;
+    {
+        size_t walk = 0;
+        for (size_t v = 0; v < visit_count; v++) {
+            if (visit_depth[v] == 0) rank[v] = walk++;
+        }
+        for (size_t k = 0; k < visit_count; ) {
+            int64_t side = visit_side[by_side[k]];
+            vector<size_t> in_ranks = side_edge_ranks(side, true);
+            symbol_limit = max(symbol_limit, walk_count + in_ranks.size());
+            for (; k < visit_count && visit_side[by_side[k]] == side; k++) {
+                size_t v = by_side[k];
+                if (visit_depth[v] == 0) continue;
+                size_t edge_rank = edge_rank_as_entity(edge_between(visit_side[v - 1], side));
+                rank[v] = walk_count + local_edge_number(in_ranks, edge_rank);
+            }
+        }
+    }
+
+    // Sort the visits by those backward sequences by prefix doubling: after
+    // each round, visits have the same rank only if their last h symbols
+    // match. Walk starts are unique, so once h covers the longest walk every
+    // rank is unique.
+    vector<size_t> order;
+    vector<size_t> scratch;
+    counting_sort(all_visits, order, symbol_limit, [&](size_t v) { return rank[v]; });
+    vector<size_t> new_rank(visit_count);
+    size_t rank_limit = symbol_limit;
+    for (size_t h = 1; h < max_walk_length; h *= 2) {
+        // The second key is the rank h steps back, or 0 if the key has already
+        // ended at its start.
+        auto back_rank = [&](size_t v) { return visit_depth[v] >= h ? rank[v - h] + 1 : 0; };
+        counting_sort(order, scratch, rank_limit + 1, back_rank);
+        counting_sort(scratch, order, rank_limit, [&](size_t v) { return rank[v]; });
+        size_t next = 0;
+        for (size_t k = 0; k < visit_count; k++) {
+            if (k > 0 && (rank[order[k]] != rank[order[k-1]] || back_rank(order[k]) != back_rank(order[k-1]))) {
+                next++;
+            }
+            new_rank[order[k]] = next;
+        }
+        std::swap(rank, new_rank);
+        rank_limit = next + 1;
+        if (rank_limit == visit_count) break;
+    }
+
+    // Now gather each side's visits in order and say where each one goes.
+    counting_sort(order, by_side, side_limit, [&](size_t v) { return visit_side[v]; });
+    for (size_t k = 0; k < visit_count; ) {
+        int64_t side = visit_side[by_side[k]];
+        int64_t node_id = rank_to_id(side / 2);
+        bool node_is_reverse = side % 2;
+        vector<size_t> out_ranks = side_edge_ranks(side, false);
+
+        vector<size_t> destinations;
+        for (; k < visit_count && visit_side[by_side[k]] == side; k++) {
+            size_t v = by_side[k];
+            if (v + 1 == visit_count || visit_depth[v + 1] == 0) {
+                // This visit ends its walk
+                destinations.push_back(BS_NULL);
+                continue;
+            }
+            Edge canonical = edge_between(side, visit_side[v + 1]);
+            size_t edge_rank = edge_rank_as_entity(canonical);
+            destinations.push_back(local_edge_number(out_ranks, edge_rank) + 2);
+            // Count the traversal of the edge in the direction we depart along it
+            h_iv[(edge_rank - 1) * 2 + depart_by_reverse(canonical, node_id, node_is_reverse)]++;
+        }
+
+        bs_set(side, destinations);
+        // Set the number of total visits to this side.
+        h_iv[(node_rank_as_entity(node_id) - 1) * 2 + node_is_reverse] = destinations.size();
+    }
+
     // Actually build the B_s arrays for rank and select.
 #ifdef VERBOSE_DEBUG
     cerr << "Creating final compressed array..." << endl;
 #endif
     bs_bake();
-    
+
     // compress the starts for the threads
     util::assign(tin_civ, int_vector<>(tin_iv));
     util::assign(tio_civ, int_vector<>(tio_iv));
@@ -2954,6 +5275,7 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t, const vector<string>
 }
 
 void XG::insert_thread(const thread_t& t, const string& name) {
+    ensure_threads();
     // We're going to insert this thread
     
     auto insert_thread_forward = [&](const thread_t& thread) {
@@ -3145,6 +5467,7 @@ void XG::insert_thread(const thread_t& t, const string& name) {
 }
 
 auto XG::extract_threads_matching(const string& pattern, bool reverse) const -> map<string, list<thread_t>> {
+    ensure_threads();
 
     map<string, list<thread_t> > found;
 
@@ -3220,6 +5543,7 @@ auto XG::extract_threads_matching(const string& pattern, bool reverse) const ->
 }
 
 auto XG::extract_threads(bool extract_reverse) const -> map<string, list<thread_t>> {
+    ensure_threads();
 
     // Fill in a map of lists of paths found by name
     map<string, list<thread_t> > found;
@@ -3332,6 +5656,7 @@ auto XG::extract_threads(bool extract_reverse) const -> map<string, list<thread_
 }
 
 XG::destination_t XG::bs_get(int64_t side, int64_t offset) const {
+    ensure_threads();
 #if GPBWT_MODE == MODE_SDSL
     if(!bs_arrays.empty()) {
         // We still have per-side arrays
@@ -3355,6 +5680,7 @@ XG::destination_t XG::bs_get(int64_t side, int64_t offset) const {
 }
 
 size_t XG::bs_rank(int64_t side, int64_t offset, destination_t value) const {
+    ensure_threads();
 #if GPBWT_MODE == MODE_SDSL
     if(!bs_arrays.empty()) {
         throw runtime_error("No rank support until bs_bake() is called!");
@@ -3374,19 +5700,22 @@ size_t XG::bs_rank(int64_t side, int64_t offset, destination_t value) const {
 #endif
 }
 
-void XG::bs_set(int64_t side, vector<destination_t> new_array) {
+void XG::bs_set(int64_t side, const vector<destination_t>& new_array) {
 #if GPBWT_MODE == MODE_SDSL
     // We always know bs_arrays will be big enough.
     
-    // Turn the new array into a string of bytes.
-    // TODO: none of the destinations can be 255 or greater!
-    bs_arrays.at(side - 2) = string(new_array.size(), 0);
-    copy(new_array.begin(), new_array.end(), bs_arrays.at(side - 2).begin());
+    // Pack the new array as tightly as its largest destination allows.
+    auto& bs_array = bs_arrays.at(side - 2);
+    bs_array = int_vector<>(new_array.size());
+    for(size_t i = 0; i < new_array.size(); i++) {
+        bs_array[i] = new_array[i];
+    }
+    util::bit_compress(bs_array);
     
 #ifdef VERBOSE_DEBUG
     cerr << "B_s for " << side << ": ";
     for(auto entry : bs_arrays.at(side - 2)) { 
-        cerr << to_string(entry);
+        cerr << entry << " ";
     }
     cerr << endl;
 #endif
@@ -3426,8 +5755,15 @@ void XG::bs_insert(int64_t side, int64_t offset, destination_t value) {
 
     auto& array_to_expand = bs_arrays.at(side - 2);
     
-    // Stick one copy of the new entry in at the right position.
-    array_to_expand.insert(offset, 1, value);
+    // Copy everything over with the new entry at the right position, widening
+    // if the new entry needs it.
+    int_vector<> expanded(array_to_expand.size() + 1, 0,
+        max<uint8_t>(array_to_expand.width(), bits::hi(value) + 1));
+    for(size_t i = 0; i < array_to_expand.size(); i++) {
+        expanded[(int64_t) i < offset ? i : i + 1] = array_to_expand[i];
+    }
+    expanded[offset] = value;
+    array_to_expand.swap(expanded);
 #elif GPBWT_MODE == MODE_DYNAMIC
      // Find the place to put it in the correct side's B_s and insert
      bs_single_array.insert(bs_single_array.select(side - 2, BS_SEPARATOR) + 1 + offset, value);
@@ -3436,52 +5772,47 @@ void XG::bs_insert(int64_t side, int64_t offset, destination_t value) {
 
 void XG::bs_bake() {
 #if GPBWT_MODE == MODE_SDSL
-    // First pass: determine required size
-    size_t total_visits = 1;
+    // First pass: find the widest destination, so the concatenated array is no
+    // wider than it has to be.
+    destination_t max_destination = BS_SEPARATOR;
     for(auto& bs_array : bs_arrays) {
-        total_visits += 1; // For the separator
-        total_visits += bs_array.size();
+        for(size_t i = 0; i < bs_array.size(); i++) {
+            max_destination = max<destination_t>(max_destination, bs_array[i]);
+        }
     }
 
-#ifdef VERBOSE_DEBUG
-    cerr << "Allocating giant B_s array of " << total_visits << " bytes..." << endl;
-#endif
-    // Move over to a single array which is big enough to start out with.
-    string all_bs_arrays(total_visits, 0);
-    
-    // Where are we writing to?
-    size_t pos = 0;
-    
-    // Start with a separator for sides 0 and 1.
-    // We don't start at run 0 because we can't select(0, BS_SEPARATOR).
-    all_bs_arrays[pos++] = BS_SEPARATOR;
-    
 #ifdef VERBOSE_DEBUG
     cerr << "Baking " << bs_arrays.size() << " sides' arrays..." << endl;
 #endif
-    
-    for(auto& bs_array : bs_arrays) {
-        // Stick everything together with a separator at the front of every
-        // range.
-        all_bs_arrays[pos++] = BS_SEPARATOR;
-        for(size_t i = 0; i < bs_array.size(); i++) {
-            all_bs_arrays[pos++] = bs_array[i];
+
+    // Stream everything out to disk instead of concatenating in memory, so we
+    // never hold the per-side arrays, the whole concatenation and the wavelet
+    // tree at once.
+    string bs_file = make_temp_file();
+    {
+        int_vector_buffer<> all_bs_arrays(bs_file, std::ios::out, 1024 * 1024, bits::hi(max_destination) + 1);
+        
+        // Start with a separator for sides 0 and 1.
+        // We don't start at run 0 because we can't select(0, BS_SEPARATOR).
+        all_bs_arrays.push_back(BS_SEPARATOR);
+        
+        for(auto& bs_array : bs_arrays) {
+            // Stick everything together with a separator at the front of every
+            // range.
+            all_bs_arrays.push_back(BS_SEPARATOR);
+            for(size_t i = 0; i < bs_array.size(); i++) {
+                all_bs_arrays.push_back(bs_array[i]);
+            }
+            // Free each side as soon as it is written.
+            util::clear(bs_array);
         }
-        bs_array.clear();
+        all_bs_arrays.close();
     }
-    
-#ifdef VERBOSE_DEBUG
-    cerr << "B_s: ";
-    for(auto entry : all_bs_arrays) { 
-        cerr << to_string(entry);
-    }
-    cerr << endl;
-#endif
-    
-    // Rebuild based on the entire concatenated string.
-    construct_im(bs_single_array, all_bs_arrays, 1);
-    
     bs_arrays.clear();
+    
+    // Build from the serialized int_vector, reading it back in a buffered way.
+    construct(bs_single_array, bs_file, 0);
+    std::remove(bs_file.c_str());
 #endif
 }
 
@@ -3505,6 +5836,7 @@ void XG::tn_bake() {
 
 
 void XG::bs_dump(ostream& out) const {
+    ensure_threads();
 #if GPBWT_MODE == MODE_SDSL
     if(!bs_arrays.empty()) {
         // We still have per-side arrays
@@ -3512,7 +5844,7 @@ void XG::bs_dump(ostream& out) const {
         for(auto& array : bs_arrays) {
             // For each side in order
             out << "---SEP---" << endl;
-            for(auto& entry : array) {
+            for(auto entry : array) {
                 if(entry == BS_NULL) {
                     // Mark nulls
                     out << "**NULL**" << endl;
@@ -3595,6 +5927,7 @@ size_t XG::count_matches(const Path& t) const {
 }
 
 void XG::extend_search(ThreadSearchState& state, const thread_t& t) const {
+    ensure_threads();
     
 #ifdef VERBOSE_DEBUG
     cerr << "Looking for path: ";
@@ -3671,24 +6004,29 @@ void XG::extend_search(ThreadSearchState& state, const thread_t& t) const {
 }
 
 void XG::extend_search(ThreadSearchState& state, const ThreadMapping& t) const {
+    ensure_threads();
     // Just make it into a temporary vector
     extend_search(state, thread_t{t});
 }
 
 int64_t XG::threads_starting_on_side(int64_t side) const {
+    ensure_threads();
     return side_thread_wt.rank(side_thread_wt.size(), side);
 }
 
 int64_t XG::thread_starting_at(int64_t side, int64_t offset) const {
+    ensure_threads();
     return side_thread_wt.select(offset+1, side)+1;
 }
 
 pair<int64_t, int64_t> XG::thread_start(int64_t thread_id, bool is_rev) const {
+    ensure_threads();
     int64_t idx = thread_id*2 + is_rev;
     return make_pair(tin_civ[idx], tio_civ[idx]);
 }
 
 string XG::thread_name(int64_t thread_id) const {
+    ensure_threads();
     // convert to forward thread
     if (thread_id > side_thread_wt.size()/2) {
         thread_id -= side_thread_wt.size()/2;
@@ -3699,6 +6037,7 @@ string XG::thread_name(int64_t thread_id) const {
 }
 
 vector<int64_t> XG::threads_named_starting(const string& pattern) const {
+    ensure_threads();
     vector<int64_t> results;
     // threads named starting with this, so add the sep character so our occs give us thread ids
     auto occs = locate(tn_csa, "$" + pattern);
@@ -3710,6 +6049,7 @@ vector<int64_t> XG::threads_named_starting(const string& pattern) const {
 }
 
 XG::ThreadSearchState XG::select_starting(const ThreadMapping& start) const {
+    ensure_threads();
     // We need to select just the threads starting at this node with this
     // mapping, rather than those coming in from elsewhere.
     
@@ -3736,6 +6076,7 @@ pair<int64_t, bool> XG::side_to_id_rev(int64_t side) const {
 }
 
 XG::ThreadSearchState XG::select_continuing(const ThreadMapping& start) const {
+    ensure_threads();
     // We need to select just the threads coming in from elsewhere, and not
     // those starting here.
     
@@ -4,7 +4,9 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <queue>
+#include <mutex>
 #include <omp.h>
 #include "cpp/vg.pb.h"
 #include "sdsl/bit_vectors.hpp"
@@ -47,6 +49,13 @@ id_t trav_id(const trav_t& trav);
 bool trav_is_rev(const trav_t& trav);
 int32_t trav_rank(const trav_t& trav);
 trav_t make_trav(id_t id, bool is_end, int32_t rank);
+// A node in one orientation, as its rank shifted up one bit, with the low
+// bit set for the reverse strand.
+struct handle_t {
+    uint64_t packed;
+};
+inline bool operator==(const handle_t& a, const handle_t& b) { return a.packed == b.packed; }
+inline bool operator!=(const handle_t& a, const handle_t& b) { return a.packed != b.packed; }
 
 /**
  * Thrown when attempting to interpret invalid data as an XG index.
@@ -56,6 +65,115 @@ class XGFormatError : public runtime_error {
     using runtime_error::runtime_error;
 };
 
+/**
+ * Collects the nodes, edges, and path steps of a graph during XG construction,
+ * deduplicates them, and hands them back in the order build() lays them out.
+ *
+ * With no memory budget everything is held in memory. With a budget, records
+ * are sorted and spilled to temporary files whenever the buffered records
+ * exceed it, and finish() k-way merges the runs into one sorted file per kind
+ * of record. The build then streams from those files, so the whole graph
+ * never has to be resident alongside the index.
+ */
+class XGBuildBuffer {
+public:
+    // A memory budget (in bytes) of 0 keeps everything in memory.
+    XGBuildBuffer(size_t memory_budget = 0);
+    ~XGBuildBuffer(void);
+
+    XGBuildBuffer(const XGBuildBuffer& other) = delete;
+    XGBuildBuffer(XGBuildBuffer&& other) = delete;
+    XGBuildBuffer& operator=(const XGBuildBuffer& other) = delete;
+    XGBuildBuffer& operator=(XGBuildBuffer&& other) = delete;
+
+    // Add a node. If the ID has been seen before, the first label wins.
+    void add_node(id_t id, const string& sequence);
+    // Add an edge between two sides. The edge must already be canonical.
+    void add_edge(side_t from, side_t to);
+    // Get a handle for the path with the given name, creating it if needed.
+    size_t add_path(const string& name);
+    // Add a step to a path. Steps may arrive in any rank order.
+    void add_path_step(size_t path, const trav_t& step);
+
+    // Sort, merge, and deduplicate everything added so far, and fill in the
+    // counts below. Exits if a path has duplicate ranks. Nothing may be added
+    // afterward.
+    void finish(void);
+
+    size_t seq_length = 0;
+    size_t node_count = 0;
+    size_t edge_count = 0;
+    size_t path_count = 0;
+    id_t min_id = 0;
+    id_t max_id = 0;
+
+    // These may only be called after finish(), but may be called repeatedly.
+    // Nodes come out in ID order.
+    void for_each_node(const function<void(id_t, const string&)>& lambda) const;
+    // Edges come out grouped by node ID and then by the side they leave
+    // from (start first), and within a side ordered by destination side.
+    void for_each_from_to(const function<void(side_t, side_t)>& lambda) const;
+    // The same, but for the edges arriving at each side.
+    void for_each_to_from(const function<void(side_t, side_t)>& lambda) const;
+    // Paths come out in name order, with their steps sorted by rank.
+    void for_each_path(const function<void(const string&, const vector<trav_t>&)>& lambda) const;
+
+    // Drop the node labels, if they are held in memory.
+    void clear_nodes(void);
+
+    // Orders records the way build() consumes them.
+    struct EdgeOrder {
+        bool operator()(const pair<side_t, side_t>& a, const pair<side_t, side_t>& b) const;
+    };
+    struct StepOrder {
+        bool operator()(const pair<size_t, trav_t>& a, const pair<size_t, trav_t>& b) const;
+    };
+
+private:
+
+    // Sort and write out everything buffered so far as new runs.
+    void spill(void);
+    // Make a new temporary file, to be removed when we are destroyed.
+    string temp_file(void);
+
+    size_t memory_budget;
+    size_t buffered_bytes = 0;
+    bool finished = false;
+
+    // Path names to handles, in name order, and the reverse.
+    map<string, size_t> path_handles;
+    vector<string> path_names;
+    // Used to warn about paths that did not arrive in rank order.
+    vector<int32_t> path_last_rank;
+    vector<bool> path_in_order;
+
+    // In-memory storage
+    map<id_t, string> node_label;
+    set<pair<side_t, side_t>, EdgeOrder> from_to;
+    set<pair<side_t, side_t>, EdgeOrder> to_from;
+    vector<vector<trav_t> > path_steps;
+
+    // External storage: records waiting to be spilled
+    vector<pair<id_t, string> > node_buffer;
+    vector<pair<side_t, side_t> > from_to_buffer;
+    vector<pair<side_t, side_t> > to_from_buffer;
+    vector<pair<size_t, trav_t> > step_buffer;
+    // Sorted runs on disk
+    vector<string> node_runs;
+    vector<string> from_to_runs;
+    vector<string> to_from_runs;
+    vector<string> step_runs;
+    // Merged and deduplicated records on disk
+    string node_file;
+    string from_to_file;
+    string to_from_file;
+    string step_file;
+    // Where each path's steps start in step_file, and how many there are
+    vector<pair<streamoff, size_t> > path_extents;
+
+    vector<string> temp_files;
+};
+
 /**
  * Provides succinct storage for a graph, its positional paths, and a set of
  * embedded threads.
@@ -86,18 +204,41 @@ public:
     
     void from_stream(istream& in, bool validate_graph = false,
         bool print_graph = false, bool store_threads = false,
-        bool is_sorted_dag = false);
+        bool is_sorted_dag = false, size_t build_memory_budget = 0);
+    // Load the graph from GFA text, taking nodes, edges, and paths straight
+    // from S, L, and P lines. Segment names must be numeric node IDs. Both
+    // GFA 1 paths and vg's one-step-per-line P records are accepted.
+    void from_gfa(istream& in, bool validate_graph = false,
+        bool print_graph = false, bool store_threads = false,
+        bool is_sorted_dag = false, size_t build_memory_budget = 0);
     void from_graph(Graph& graph, bool validate_graph = false,
         bool print_graph = false, bool store_threads = false,
         bool is_sorted_dag = false);
+    // Build this index out of several other indexes whose node ID ranges do
+    // not overlap, without going back to the source graphs. Paths with the
+    // same name in more than one part are joined, and must not share ranks.
+    void merge(const vector<const XG*>& parts, bool validate_graph = false,
+        bool print_graph = false, bool store_threads = false,
+        bool is_sorted_dag = false, size_t build_memory_budget = 0);
     // Load the graph by calling a function that calls us back with graph chunks.
     // The function passed in here is responsible for looping.
     // If is_sorted_dag is true and store_threads is true, we store the threads
     // with an algorithm that only works on topologically sorted DAGs, but which
     // is faster.
+    // If build_memory_budget is nonzero, the graph is collected out of core,
+    // spilling to temporary files in $TMPDIR (or /tmp) whenever more than that
+    // many bytes of nodes, edges, and path steps are buffered.
     void from_callback(function<void(function<void(Graph&)>)> get_chunks,
         bool validate_graph = false, bool print_graph = false,
-        bool store_threads = false, bool is_sorted_dag = false); 
+        bool store_threads = false, bool is_sorted_dag = false,
+        size_t build_memory_budget = 0);
+    // Build the index from a finished build buffer.
+    void build(XGBuildBuffer& buffer,
+               bool validate_graph,
+               bool print_graph,
+               bool store_threads,
+               bool is_sorted_dag);
+    // Build the index from in-memory maps. The maps are emptied.
     void build(map<id_t, string>& node_label,
                map<side_t, set<side_t> >& from_to,
                map<side_t, set<side_t> >& to_from,
@@ -108,13 +249,29 @@ public:
                bool is_sorted_dag);
                
     // What's the maximum XG version number we can read with this code?
-    const static uint32_t MAX_INPUT_VERSION = 1;
+    const static uint32_t MAX_INPUT_VERSION = 9;
     // What's the version we serialize?
-    const static uint32_t OUTPUT_VERSION = 1;
+    const static uint32_t OUTPUT_VERSION = 9;
                
     // Load this XG index from a stream. Throw an XGFormatError if the stream
     // does not produce a valid XG file.
     void load(istream& in);
+    // Groups of sections that can be left out of a load.
+    enum LoadSections {
+        LOAD_PATHS = 1,
+        LOAD_THREADS = 2,
+        LOAD_ALL = LOAD_PATHS | LOAD_THREADS
+    };
+    // Load this XG index from a file, reading it through a read-only memory
+    // mapping. Every structure is copied out of the mapping, since the SDSL
+    // containers own their storage. Sequence and edges are always loaded.
+    // From a version 5 file, path and thread sections not in eager_sections
+    // stay mapped until a query first needs them. Throw an XGFormatError if
+    // the file is not a valid XG file.
+    void load(const string& filename, int eager_sections = LOAD_ALL);
+    // Check the checksums of every section in a file without loading it.
+    // Problems are described on report. Returns true if the file is intact.
+    static bool verify_file(const string& filename, ostream& report);
     size_t serialize(std::ostream& out,
                      sdsl::structure_tree_node* v = NULL,
                      std::string name = "");
@@ -140,11 +297,14 @@ public:
     int64_t where_to(int64_t current_side, int64_t visit_offset, int64_t new_side,
       vector<Edge>& edges_into_new, vector<Edge>& edges_out_of_old) const;
 
+    // The packed sequence, two bits per base. Ns are not marked in it.
     const uint64_t* sequence_data(void) const;
     const size_t sequence_bit_size(void) const;
     size_t id_to_rank(int64_t id) const;
     int64_t rank_to_id(size_t rank) const;
     size_t max_node_rank(void) const;
+    int64_t min_node_id(void) const;
+    int64_t max_node_id(void) const;
     int64_t node_at_seq_pos(size_t pos) const;
     size_t node_start(int64_t id) const;
     Node node(int64_t id) const; // gets node sequence
@@ -152,6 +312,78 @@ public:
     size_t node_length(int64_t id) const;
     char pos_char(int64_t id, bool is_rev, size_t off) const; // character at position
     string pos_substr(int64_t id, bool is_rev, size_t off, size_t len = 0) const; // substring in range
+
+    // A window on part of the stored sequence, read straight out of the
+    // packed bases without allocating. A reverse view reads the reverse
+    // complement. Views are only good as long as the index they come from.
+    class SequenceView {
+    public:
+        class const_iterator {
+        public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef char value_type;
+            typedef ptrdiff_t difference_type;
+            typedef const char* pointer;
+            typedef char reference;
+
+            const_iterator(void) = default;
+            const_iterator(const XG* graph, size_t origin, bool is_reverse, size_t index)
+                : graph(graph), origin(origin), is_reverse(is_reverse), index(index) { }
+
+            char operator*(void) const;
+            char operator[](difference_type n) const { return *(*this + n); }
+            const_iterator& operator++(void) { ++index; return *this; }
+            const_iterator operator++(int) { const_iterator old = *this; ++index; return old; }
+            const_iterator& operator--(void) { --index; return *this; }
+            const_iterator operator--(int) { const_iterator old = *this; --index; return old; }
+            const_iterator& operator+=(difference_type n) { index += n; return *this; }
+            const_iterator& operator-=(difference_type n) { index -= n; return *this; }
+            const_iterator operator+(difference_type n) const { return const_iterator(graph, origin, is_reverse, index + n); }
+            const_iterator operator-(difference_type n) const { return const_iterator(graph, origin, is_reverse, index - n); }
+            difference_type operator-(const const_iterator& other) const { return index - other.index; }
+            bool operator==(const const_iterator& other) const { return index == other.index; }
+            bool operator!=(const const_iterator& other) const { return index != other.index; }
+            bool operator<(const const_iterator& other) const { return index < other.index; }
+            bool operator<=(const const_iterator& other) const { return index <= other.index; }
+            bool operator>(const const_iterator& other) const { return index > other.index; }
+            bool operator>=(const const_iterator& other) const { return index >= other.index; }
+            friend const_iterator operator+(difference_type n, const const_iterator& it) { return it + n; }
+
+        private:
+            const XG* graph = nullptr;
+            // Where in s_iv the first base is; reverse views go down from it.
+            size_t origin = 0;
+            bool is_reverse = false;
+            size_t index = 0;
+        };
+
+        SequenceView(void) = default;
+        SequenceView(const XG* graph, size_t start, size_t length, bool is_reverse)
+            : graph(graph), start(start), length(length), is_reverse(is_reverse) { }
+
+        size_t size(void) const { return length; }
+        bool empty(void) const { return length == 0; }
+        char operator[](size_t i) const { return *(begin() + i); }
+        const_iterator begin(void) const;
+        const_iterator end(void) const { return begin() + length; }
+        // The same bases read from the other strand
+        SequenceView reverse_complement(void) const;
+        // Part of the view, clipped to its end
+        SequenceView substr(size_t off, size_t len = numeric_limits<size_t>::max()) const;
+        // Decode the whole view into out, which needs room for size() bases.
+        void copy_to(char* out) const;
+        string str(void) const;
+
+    private:
+        const XG* graph = nullptr;
+        // The bases are s_iv[start, start + length), however they are read.
+        size_t start = 0;
+        size_t length = 0;
+        bool is_reverse = false;
+    };
+    SequenceView node_view(int64_t id, bool is_rev = false) const;
+    // The same range as pos_substr
+    SequenceView pos_view(int64_t id, bool is_rev, size_t off, size_t len = 0) const;
     Edge edge_for_entity(size_t rank) const;
     vector<Edge> edges_of(int64_t id) const;
     vector<Edge> edges_to(int64_t id) const;
@@ -174,6 +406,23 @@ public:
     /// Returns true if the given edge is present in either orientation, and false otherwise.
     bool has_edge(const Edge& edge) const;
 
+    // Handles walk the graph straight off the edge tables, without building
+    // Edges or allocating.
+    handle_t get_handle(int64_t id, bool is_reverse = false) const;
+    int64_t get_id(const handle_t& handle) const;
+    bool get_is_reverse(const handle_t& handle) const;
+    handle_t flip(const handle_t& handle) const;
+    size_t get_length(const handle_t& handle) const;
+    /// Call iteratee with each handle we can step to off the end of the given
+    /// one, in the orientation we would read it. If go_left, call it instead
+    /// with each handle that reads into the given one across its start, as
+    /// vg's HandleGraph does. Stops early, and returns false, if iteratee
+    /// returns false.
+    bool follow_edges(const handle_t& handle, bool go_left,
+                      const function<bool(const handle_t&)>& iteratee) const;
+    /// The number of edges on the end of the handle, or on its start if go_left
+    size_t degree(const handle_t& handle, bool go_left) const;
+
     // Pull out the path with the given name.
     Path path(const string& name) const;
     // Returns the rank of the path with the given name, or 0 if no such path
@@ -271,7 +520,11 @@ public:
     
 #if GPBWT_MODE == MODE_SDSL
     // We keep our strings in instances of this cool run-length-compressed wavelet tree.
-    using rank_select_int_vector = sdsl::wt_rlmn<sdsl::sd_vector<>>;
+    // Its run heads go in an integer wavelet tree, so destinations aren't limited to a byte.
+    using rank_select_int_vector = sdsl::wt_rlmn<sdsl::sd_vector<>, sdsl::sd_vector<>::rank_1_type,
+        sdsl::sd_vector<>::select_1_type, sdsl::wt_huff_int<>>;
+    // Before version 3, B_s was stored over a byte alphabet in this.
+    using byte_rank_select_int_vector = sdsl::wt_rlmn<sdsl::sd_vector<>>;
 #elif GPBWT_MODE == MODE_DYNAMIC
     using rank_select_int_vector = dyn::rle_str;
 #endif
@@ -308,6 +561,12 @@ public:
     /// Otherwise the gPBWT data structures will be left in an inconsistent
     /// state.
     void insert_threads_into_dag(const vector<thread_t>& t, const vector<string>& names);
+    /// Insert a whole group of threads into any graph, cycles and inversions
+    /// included. The visits to each side are sorted all at once by the
+    /// sequence of edges taken to reach them, and the B_s arrays are laid out
+    /// as insert_threads_into_dag() lays them out. The same conditions apply:
+    /// call it only once, with no threads inserted previously.
+    void insert_threads_into_graph(const vector<thread_t>& t, const vector<string>& names);
     /// Read all the threads embedded in the graph.
     map<string, list<thread_t> > extract_threads(bool extract_reverse) const;
     /// Extract a particular thread by name. Name may not be empty.
@@ -390,11 +649,126 @@ public:
     
     char start_marker;
     char end_marker;
+
+    // When validating a build, check only this fraction of the nodes, edges
+    // and path steps, picked at random. At 1 everything is checked.
+    double validate_fraction = 1.0;
+
+    // When set before building or loading, also keep where each node starts
+    // in a plain array, so node boundaries are found without select on the
+    // compressed node start vector. It costs about log2 of the sequence
+    // length in bits per node, and is never saved.
+    bool dense_node_starts = false;
+    // Build that array now, for an index already built or loaded.
+    void index_node_starts(void);
+
+    // When set before building, also build an FM-index over the node
+    // sequences, for exact match search. It is saved with the index.
+    bool index_sequence = false;
+    bool has_sequence_index(void) const;
+    // Search ranges are inclusive ranges of rows in the FM-index, and are
+    // empty when first > last. Matches never span two nodes, and only the
+    // forward strand is searched.
+    // The range of rows where the pattern occurs
+    pair<size_t, size_t> sequence_range(const string& pattern) const;
+    // Narrow a range to the occurrences with one more base before them
+    pair<size_t, size_t> extend_sequence_range(const pair<size_t, size_t>& range, char base) const;
+    // Where the occurrences in a range start, as node ID and offset pairs
+    vector<pair<int64_t, size_t>> locate_sequence(const pair<size_t, size_t>& range) const;
+    vector<pair<int64_t, size_t>> locate_sequence(const string& pattern) const;
     
 private:
 
+    // Files from version 5 on are made of sections, listed in a table of
+    // contents after the header. Every section starts SECTION_ALIGNMENT-byte
+    // aligned in the file. After the fixed sections comes one per path. From
+    // version 6 on, the table and each section are followed by a checksum.
+    enum Section {
+        META_SECTION = 0, // counts and the ID to rank mapping
+        SEQUENCE_SECTION,
+        EDGES_SECTION,
+        THREAD_NAMES_SECTION, // thread names and thread starts
+        PATH_NAMES_SECTION,
+        ENTITY_PATHS_SECTION,
+        GPBWT_SECTION,
+        FIRST_PATH_SECTION
+    };
+    const static size_t SECTION_ALIGNMENT = 8;
+    // Where a section is in the file, in bytes from the start of the file.
+    struct SectionEntry {
+        uint64_t offset;
+        uint64_t size;
+    };
+    // Write or read one section, without any alignment padding. Sections
+    // from older versions are converted as they are read.
+    size_t serialize_section(size_t section, ostream& out, sdsl::structure_tree_node* parent);
+    void load_section(size_t section, istream& in, uint32_t file_version);
+    // Read the rest of a version 5 or later file, after its magic number and
+    // version.
+    void load_sections(istream& in, uint32_t file_version);
+    // Read and check the table of contents of a mapped file.
+    static void read_table_of_contents(const char* data, size_t size, uint32_t file_version,
+                                       vector<SectionEntry>& toc);
+    static uint64_t toc_checksum_of(uint64_t section_count, const vector<SectionEntry>& toc);
+
+    // A file we have mapped to load sections from on demand, and its table of
+    // contents.
+    const char* mapped_file = nullptr;
+    size_t mapped_size = 0;
+    vector<SectionEntry> mapped_toc;
+    uint32_t mapped_version = 0;
+    // Which groups are still waiting in the mapping to be loaded.
+    bool paths_pending = false;
+    bool threads_pending = false;
+    mutable once_flag paths_loaded;
+    mutable once_flag threads_loaded;
+    // Held while loading from the mapping, and while checking the pending
+    // groups and unmapping, which paths and threads may do at once.
+    mutable mutex mapping_mutex;
+    // Sections loaded together, in the order we list them.
+    vector<size_t> path_sections(void) const;
+    vector<size_t> thread_sections(void) const;
+    // Load sections from the mapped file, in parallel.
+    void load_mapped_sections(const vector<size_t>& sections);
+    // Load sections from where they sit in memory, in parallel. From version
+    // 6 on, each is followed by a checksum that it must match.
+    void load_sections_parallel(const vector<size_t>& sections,
+                                const vector<const char*>& starts,
+                                const vector<size_t>& sizes,
+                                uint32_t file_version);
+    // Load the path or thread sections, if they were left for later. Every
+    // query that uses them has to call these first.
+    void ensure_paths(void) const;
+    void ensure_threads(void) const;
+    // Unmap the file once nothing is left to load from it. Must be called
+    // with mapping_mutex held.
+    void release_mapping(void);
+
     // sequence/integer vector
-    int_vector<> s_iv;
+    // Bases are packed in two bits each, coded as in dna3bit. Anything else
+    // reads back as N; those positions are stored as A and marked in sn_sdv.
+    int_vector<2> s_iv;
+    sd_vector<> sn_sdv;
+    sd_vector<>::rank_1_type sn_sdv_rank;
+    sd_vector<>::select_1_type sn_sdv_select;
+    // Decode the bases from start up to end into out.
+    void decode_sequence(size_t start, size_t end, char* out) const;
+    char base_at(size_t pos) const;
+    // Mark where the Ns are, given their positions in order.
+    void index_n_positions(const vector<uint64_t>& positions);
+    // Fill in s_iv and the N positions from the 3-bit vector used before
+    // version 7.
+    void pack_sequence(const int_vector<>& bases_3bit);
+    // FM-index over the node sequences, each followed by a delimiter, and
+    // where each node's sequence starts in its text. Empty unless built
+    // with index_sequence.
+    csa_wt<> s_csa;
+    sd_vector<> sl_sdv;
+    sd_vector<>::rank_1_type sl_sdv_rank;
+    sd_vector<>::select_1_type sl_sdv_select;
+    const static char SEQUENCE_DELIMITER;
+    // Build them from s_iv and s_bv, during build.
+    void build_sequence_index(void);
     // node starts in sequence, provides id schema
     // rank_1(i) = id
     // select_1(id) = i
@@ -405,12 +779,26 @@ private:
     rrr_vector<> s_cbv;
     rrr_vector<>::rank_1_type s_cbv_rank;
     rrr_vector<>::select_1_type s_cbv_select;
+    // Where the node of each rank starts in s_iv, at rank - 1, followed by
+    // the sequence length. Empty unless dense_node_starts is set.
+    int_vector<> node_starts;
+    // Where the node of a rank starts, and where the next one would.
+    size_t rank_start(size_t rank) const;
+    size_t rank_end(size_t rank) const;
 
     // maintain old ids from input, ranked as in s_iv and s_bv
     int_vector<> i_iv;
     int64_t min_id; // id ranges don't have to start at 0
     int64_t max_id;
     int_vector<> r_iv; // ids-id_min is the rank
+    // When IDs are sparse we mark ids-id_min here instead, and the rank among
+    // the marked IDs is the rank.
+    bool sparse_ids = false;
+    sd_vector<> r_sdv;
+    sd_vector<>::rank_1_type r_sdv_rank;
+    // Use the sparse mapping when the ID range is this many times the number
+    // of nodes.
+    const static size_t SPARSE_ID_RANGE_FACTOR = 8;
 
     // maintain forward links
     int_vector<> f_iv;
@@ -435,6 +823,28 @@ private:
     sd_vector<> t_from_start_cbv;
     sd_vector<> t_to_end_cbv;
 
+    // The same edges again, grouped by the node side they leave from, so one
+    // side's edges are a single scan. Side (rank - 1) * 2 is the start of
+    // the node and the side after it the end. Each entry is the handle we
+    // step to, shifted up one bit, with the low bit set if we leave along
+    // the edge from its from side, as it is stored. Each side's entries are
+    // in the order edges_of gives them, which the B_s arrays depend on.
+    // Files before version 9 don't have these, and we use the tables above
+    // instead.
+    int_vector<> sa_iv;
+    // Where each side's entries start in sa_iv, then the size of sa_iv
+    int_vector<> sa_offsets;
+    // Build sa_iv and sa_offsets from the tables above.
+    void index_side_adjacency(void);
+    // Call fn with the handle at the other end of each edge leaving a side
+    // of a node, and whether we leave along it from its from side, reading
+    // the tables above in edges_of order. Stops early, and returns false, if
+    // fn does.
+    bool for_each_table_edge(size_t rank, bool leave_start,
+                             const function<bool(const handle_t&, bool)>& fn) const;
+    // The edges on one side of a node, from sa_iv
+    vector<Edge> side_edges(int64_t id, bool on_start) const;
+
     // edge table, allows o(1) determination of edge existence
     int_vector<> e_iv;
 
@@ -498,7 +908,7 @@ private:
 #if GPBWT_MODE == MODE_SDSL
     // We use this for creating the sub-parts of the uncompressed B_s arrays.
     // We don't really support rank and select on this.
-    vector<string> bs_arrays;
+    vector<int_vector<>> bs_arrays;
 #endif
     
     // This holds the concatenated Benedict arrays, with BS_SEPARATOR separating
@@ -513,7 +923,8 @@ private:
     // thread name storage
     // CSA that lets us look up names efficiently, build from ordered null-delimited names
     // thread ids are taken to be the rank in the source text for tn_csa
-    csa_bitcompressed<> tn_csa;
+    // Like pn_csa this samples its suffix array instead of storing all of it.
+    csa_wt<> tn_csa;
     // allows us to go from positions in the CSA to thread ids
     // rank(i) gives us our thread index for a position in tn_csa's source
     // select(i) gives us the thread name start for a given thread id
@@ -548,16 +959,28 @@ private:
     size_t bs_rank(int64_t side, int64_t offset, destination_t value) const;
     // Set the whole B_s array for a size. May throw an error if B_s for that
     // side has already been set (as overwrite is not necessarily possible).
-    void bs_set(int64_t side, vector<destination_t> new_array);
+    void bs_set(int64_t side, const vector<destination_t>& new_array);
     // Insert into the B_s array for a side
     void bs_insert(int64_t side, int64_t offset, destination_t value);
     
     // Prepare the B_s array data structures for query. After you call this, you
-    // shouldn't call bset or bs_insert.
+    // shouldn't call bset or bs_insert. The per-side arrays are streamed
+    // through a temporary file and freed as they go.
     void bs_bake();
     
     // Prepare the succinct thread name representation for queries
     void tn_bake();
+
+    // How many graph chunks to read per thread at a time in from_stream().
+    const static size_t CHUNKS_PER_THREAD = 4;
+
+    // Compare the name of the path at the given rank to the given name, like
+    // string::compare.
+    int compare_path_name(size_t rank, const string& name) const;
+
+    // Build the entity to path index (ep_iv and ep_bv) from the membership
+    // vectors of the paths, in time proportional to the total membership.
+    void index_entity_paths(size_t entity_count);
 };
 
 class XGPath {
@@ -5,7 +5,7 @@ BASH_TAP_ROOT=../bash-tap
 
 PATH=../bin:$PATH # for xg
 
-plan tests 12
+plan tests 33
 
 is $(xg -Vv data/l.vg 2>&1 | grep ok | wc -l) 1 "a small graph verifies"
 is $(xg -Vv data/lg.vg 2>&1 | grep ok | wc -l) 1 "a small graph with two named paths verifies"
@@ -26,4 +26,72 @@ rm c.idx
 is $(xg -Vrv data/cyclic_path.vg 2>&1 | grep ok | wc -l) 1 "a graph with a path cycle validates"
 
 is $(xg -Vrv data/self_loop_paths.vg 2>&1 | grep ok | wc -l) 1 "a small graph with all self loops validates"
+printf "S\t1\tGAT\nS\t2\tTACA\nL\t1\t+\t2\t+\t0M\nL\t9\t+\t1\t+\t0M\nL\t2\t+\t8\t+\t0M\n" > dangling.gfa
+is $(xg -Vg dangling.gfa 2>&1 | grep ok | wc -l) 1 "edges to and from missing nodes are skipped when validating"
+rm -f dangling.gfa
 is $(xg -Vrv data/b.vg 2>&1 | grep ok | wc -l) 1 "a large graph with doubly-reversing edges validates"
+
+is $(xg -Vrdv data/z.vg -m 1 2>&1 | grep ok | wc -l) 1 "a graph built out of core verifies"
+is $(xg -q 0.1 -rdv data/z.vg 2>&1 | grep -c "95% confidence") 1 "sampled validation reports its confidence"
+xg -v data/z.vg -o z.mem.idx 2>/dev/null
+xg -v data/z.vg -m 1 -o z.ext.idx 2>/dev/null
+is $(cmp z.mem.idx z.ext.idx && echo same) same "out-of-core construction produces the same index as in-memory construction"
+rm -f z.mem.idx z.ext.idx
+
+xg -v data/lg.vg -j 1 -o lg.1.idx 2>/dev/null
+xg -v data/lg.vg -j 4 -o lg.4.idx 2>/dev/null
+is $(cmp lg.1.idx lg.4.idx && echo same) same "parallel construction produces the same index as serial construction"
+rm -f lg.1.idx lg.4.idx
+
+xg -rdv data/z.vg -j 1 -o z.1.idx 2>/dev/null
+xg -rdv data/z.vg -j 4 -o z.4.idx 2>/dev/null
+is $(cmp z.1.idx z.4.idx && echo same) same "threads stored in parallel match threads stored serially"
+rm -f z.1.idx z.4.idx
+
+rm -f @pathnames.iv
+xg -v data/xyz.vg -o xyz.idx 2>/dev/null
+is $(ls | grep -c pathnames) 0 "path names are indexed without temporary files in the working directory"
+rm -f xyz.idx
+
+is $(xg -Vrg data/ll.gfa 2>&1 | grep ok | wc -l) 1 "a graph can be built directly from GFA"
+is "$(xg -g data/ll.gfa -s 4)" "4: CTGGAACAAGAACCCAGTGCTCTTTCTGCTCTACCCACTGACCCATCCTCTCAC" "nodes built from GFA have their sequences"
+is $(xg -Vrdg data/inv.gfa 2>&1 | grep ok | wc -l) 1 "threads batch-inserted across an inversion validate"
+is "$(xg -rdg data/inv.gfa -x -T | md5sum)" "$(xg -rg data/inv.gfa -x -T | md5sum)" "batch and one-at-a-time thread insertion agree across an inversion"
+printf "H\tVN:Z:1.0\nS\t1\tGAT\nS\t2\tTACA\nL\t1\t+\t2\t-\t0M\nP\tx\t1+,2-\t0M\n" > gfa1.gfa
+is $(xg -Vrg gfa1.gfa 2>&1 | grep ok | wc -l) 1 "GFA 1 paths can be read"
+rm -f gfa1.gfa
+
+printf "S\t1\tGATNNACGTTNAC\nS\t2\tNNNNN\nL\t1\t+\t2\t+\t0M\n" > ns.gfa
+is "$(xg -g ns.gfa -s 1; xg -g ns.gfa -s 2)" "$(printf '1: GATNNACGTTNAC\n2: NNNNN')" "Ns survive sequence packing"
+rm -f ns.gfa
+
+# A hub with more than 255 edges leaving one side, so thread destinations
+# need more than a byte
+{
+    printf "S\t1\tA\n"
+    for i in $(seq 2 301); do printf "S\t%d\tG\n" $i; done
+    printf "S\t302\tC\n"
+    for i in $(seq 2 301); do printf "L\t1\t+\t%d\t+\t0M\nL\t%d\t+\t302\t+\t0M\n" $i $i; done
+    for i in 2 200 256 257 301; do printf "P\tx%d\t1+,%d+,302+\t*\n" $i $i; done
+} > hub.gfa
+# Threads that read forward come out starting at the hub
+hub_threads() {
+    xg $1 hub.gfa -x -T | awk -F'\t' '$1 == "P" { s[$3] = s[$3] (s[$3] == "" ? "" : ",") $2 $5 } END { for (n in s) print s[n] }' | grep '^1+' | sort
+}
+hub_paths="$(for i in 2 200 256 257 301; do echo "1+,$i+,302+"; done | sort)"
+is $(xg -Vrg hub.gfa 2>&1 | grep ok | wc -l) 1 "threads through a side with over 255 edges validate"
+is $(xg -Vrdg hub.gfa 2>&1 | grep ok | wc -l) 1 "threads batch-inserted through a side with over 255 edges validate"
+is "$(hub_threads -rg)" "$hub_paths" "threads through a side with over 255 edges can be extracted"
+is "$(hub_threads -rdg)" "$hub_paths" "batch-inserted threads through a side with over 255 edges can be extracted"
+rm -f hub.gfa
+
+# IDs spread much wider than the node count are stored sparsely; the same
+# graph with dense IDs should answer the same way
+printf "S\t1\tGATT\nS\t500000\tACA\nS\t1000000\tTTAG\nL\t1\t+\t500000\t+\t0M\nL\t500000\t+\t1000000\t-\t0M\nP\ts\t1+,500000+,1000000-\t*\n" > sparse.gfa
+sed 's/1000000/3/g; s/500000/2/g' sparse.gfa > dense.gfa
+densify() { sed 's/1000000/3/g; s/500000/2/g'; }
+is $(xg -Vrg sparse.gfa 2>&1 | grep ok | wc -l) 1 "a graph with sparse node IDs validates"
+is "$(xg -g sparse.gfa -s 500000)" "500000: ACA" "nodes with sparse IDs have their sequences"
+is "$(xg -g sparse.gfa -f 500000 | densify)" "$(xg -g dense.gfa -f 2)" "nodes with sparse IDs have their edges"
+is "$(xg -g sparse.gfa -p s:0-10 -T | densify)" "$(xg -g dense.gfa -p s:0-10 -T)" "paths over sparse IDs can be queried"
+rm -f sparse.gfa dense.gfa
@@ -5,7 +5,7 @@ BASH_TAP_ROOT=../bash-tap
 
 PATH=../bin:$PATH # for xg
 
-plan tests 20
+plan tests 29
 
 xg -v data/z.vg -o z.idx 2>/dev/null
 is $(xg -i z.idx -s 10331 | cut -f 2 -d\ ) "CAGCAGTGGAGCAGAAACAGAGGAGATGACACCATGGGGTAAGCACAGTC" "graph can be queried to obtain node labels"
@@ -23,11 +23,25 @@ is $(xg -P 3:0 -i l.idx) "T" "characters on the forward strand may be queried"
 is $(xg -P 3:-0 -i l.idx) "A" "characters on the reverse strand may be queried"
 is $(xg -P 4:0 -i l.idx | head -c 1) $(xg -F 4:0:0 -i l.idx | head -c 1) "obtaining the node sequence works as expected on the forward strand"
 is $(xg -P 4:-0 -i l.idx | head -c 1) $(xg -F 4:-0:0 -i l.idx | head -c 1)  "obtaining the node sequence works as expected on the reverse strand"
+is "$(xg -N -i l.idx -F 4:-0:0 -P 3:-0 -p z:0-10 | md5sum)" "$(xg -i l.idx -F 4:-0:0 -P 3:-0 -p z:0-10 | md5sum)" "dense node starts give the same answers"
 
 is $(xg -i l.idx -p z:0-10 | md5sum | cut -f 1 -d\ ) "ee265e344d67e72b43589934e5257a9b" "paths can be queried from the small graph"
 is $(xg -i l.idx -p z:0-100 -c 2 | md5sum | cut -f 1 -d\ ) "76ee1e231d3985d63dbf0abe083b4805" "the entire graph can be extracted with a long query and context"
 rm -f l.idx
 
+xg -v data/l.vg -I -o l.idx 2>/dev/null
+is "$(xg -i l.idx -l $(xg -i l.idx -s 4 | cut -f 2 -d\ ) | grep -c '^4:0$')" "1" "node sequences can be found with the sequence FM-index"
+rm -f l.idx
+is "$(xg -Ig data/inv.gfa -l TAG)" "4:1" "matches inside the last node are located"
+is "$(xg -Ig data/inv.gfa -l 'T$A' | wc -l)" "0" "patterns cannot span two nodes through the delimiter"
+
+printf "S\t1\tA\nS\t2\tC\nL\t1\t+\t1\t+\t0M\nL\t2\t+\t2\t-\t0M\nL\t1\t+\t2\t+\t0M\n" > loops.gfa
+is "$(xg -g loops.gfa -a 1+)" "$(printf 'left 1: 1+\nright 2: 1+ 2+')" "handles follow self loops once on each side"
+is "$(xg -g loops.gfa -a 2-)" "$(printf 'left 1: 2+\nright 1: 1-')" "handles follow reversing self loops from the reverse strand"
+is "$(xg -g data/inv.gfa -a 2+)" "$(printf 'left 2: 1+ 3-\nright 1: 4+')" "handles to the left read into the handle across an inversion"
+is "$(xg -g loops.gfa -a 1+ -k 1)" "$(printf 'left 1: 1+\nright 2: 1+')" "following edges stops when asked to"
+rm -f loops.gfa
+
 xg -v data/cyclic_path.vg -o c.xg
 is $(xg -i c.xg -n 1 -c 10 | md5sum | cut -f 1 -d\ ) "894aa7bbe909b5e4e0660b377e5d19d8" "a graph containing cyclic paths can be rebuild from the index"
 rm c.xg
@@ -55,3 +69,7 @@ is $(xg -S 1 -i c.idx | grep '4+ -> 1+' | wc -l) 1 "can obtain edges on start"
 is $(xg -E 1 -i c.idx | grep '1+ -> 2+' | wc -l) 1 "can obtain edges on end"
 
 rm c.idx
+
+xg -rv data/lg.vg -o lg.idx 2>/dev/null
+is "$(xg -i lg.idx -x | md5sum)" "$(xg -rv data/lg.vg -x | md5sum)" "threads are loaded on demand when an index is loaded lazily"
+rm -f lg.idx
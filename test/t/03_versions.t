@@ -5,7 +5,7 @@ BASH_TAP_ROOT=../bash-tap
 
 PATH=../bin:$PATH # for xg
 
-plan tests 4
+plan tests 11
 
 # Make sure we can read various old versions of XG format.
 xg -i data/versions/v00.xg -o /dev/null
@@ -17,7 +17,26 @@ is $? 0 "XG version 1 can be deserialized"
 is "$(xg -i data/versions/vLarge.xg -o /dev/null 2>&1 | grep 'too new' | wc -l)" "1" "Future XG versions are rejected"
 
 xg -v data/l.vg -o serialized.xg
-is "$(cat serialized.xg | head -c6 | tail -c4 | xxd | cut -d' ' -f2,3 | tr -d ' ')" "00000001" "New XG files are written in version 1 format"
-rm -f serialized.xg
+is "$(cat serialized.xg | head -c6 | tail -c4 | xxd | cut -d' ' -f2,3 | tr -d ' ')" "00000009" "New XG files are written in version 9 format"
+xg -i serialized.xg -o reserialized.xg
+is "$(cmp serialized.xg reserialized.xg && echo same)" "same" "Version 9 files load and serialize back to the same bytes"
+xg -i - -o streamed.xg < serialized.xg
+is "$(cmp serialized.xg streamed.xg && echo same)" "same" "Version 9 files can be loaded from a stream"
+xg -i serialized.xg -o - | cat > piped.xg
+is "$(cmp serialized.xg piped.xg && echo same)" "same" "Version 9 files can be written to a pipe"
+xg -C serialized.xg 2>/dev/null
+is $? 0 "Intact files pass their checksums"
+head -c -16 serialized.xg > truncated.xg
+is "$(xg -C truncated.xg 2>&1 | grep -c truncated)" "1" "Truncated files are caught by their table of contents"
+# Damage the middle of the sequence section, whose table of contents entry
+# follows the 8 byte header, the section count and the first section's entry.
+read_u64() { od -An -t u8 -j $1 -N 8 serialized.xg | tr -d ' '; }
+middle=$(( $(read_u64 32) + $(read_u64 40) / 2 ))
+cp serialized.xg corrupted.xg
+if [ "$(dd if=serialized.xg bs=1 skip=$middle count=1 2>/dev/null | xxd -p)" = "00" ]; then byte='\001'; else byte='\000'; fi
+printf "$byte" | dd of=corrupted.xg bs=1 seek=$middle conv=notrunc 2>/dev/null
+is "$(xg -C corrupted.xg 2>&1 | grep -c 'fails its checksum')" "1" "Corrupted files are caught by checking them"
+is "$(xg -i - -o /dev/null < corrupted.xg 2>&1 | grep -c 'fails its checksum')" "1" "Corrupted files are caught by loading them"
+rm -f serialized.xg reserialized.xg streamed.xg piped.xg truncated.xg corrupted.xg
 
 
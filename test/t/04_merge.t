@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+
+BASH_TAP_ROOT=../bash-tap
+. ../bash-tap/bash-tap-bootstrap
+
+PATH=../bin:$PATH # for xg
+
+plan tests 3
+
+printf "S\t1\tGAT\nS\t2\tTACA\nL\t1\t+\t2\t+\t0M\nP\tx\t1+,2+\t*\n" > a.gfa
+printf "S\t10\tCC\nS\t11\tGG\nS\t12\tA\nL\t10\t+\t11\t-\t0M\nL\t11\t-\t12\t+\t0M\nP\ty\t10+,11-,12+\t*\n" > b.gfa
+cat a.gfa b.gfa > ab.gfa
+xg -g a.gfa -o a.xg
+xg -g b.gfa -o b.xg
+xg -g ab.gfa -o ab.xg
+
+xg -M b.xg -M a.xg -o merged.xg
+is $(cmp merged.xg ab.xg && echo same) same "merging indexes gives the same index as building them together"
+is $(xg -VM a.xg -M b.xg 2>&1 | grep ok | wc -l) 1 "a merged index validates"
+is "$(xg -M a.xg -M a.xg -o /dev/null 2>&1 | grep overlapping | wc -l)" "1" "indexes with overlapping node ID ranges cannot be merged"
+
+rm -f a.gfa b.gfa ab.gfa a.xg b.xg ab.xg merged.xg
@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+
+BASH_TAP_ROOT=../bash-tap
+. ../bash-tap/bash-tap-bootstrap
+
+PATH=../bin:$PATH # for xg
+
+plan tests 5
+
+# Split a graph into two shards with their own ID ranges and paths
+xg -g data/inv.gfa -o a.xg
+printf 'H\tVN:Z:1.0\nS\t10\tCATG\nS\t11\tGG\nS\t12\tTACC\nL\t10\t+\t11\t+\t0M\nL\t11\t+\t12\t+\t0M\nL\t10\t+\t12\t+\t0M\nP\tq\t10+,11+,12+\t*\n' > b.gfa
+xg -g b.gfa -o b.xg
+
+is "$(xg -H a.xg -H b.xg -s 11)" "$(xg -i b.xg -s 11)" "node sequences come from the shard holding the node"
+is "$(xg -K 1 -H a.xg -H b.xg -s 11 -P 2:-0 -F 12:1:2 -p p1:0-5 -T | md5sum)" \
+   "$( (xg -i b.xg -s 11; xg -i a.xg -P 2:-0; xg -i b.xg -F 12:1:2; xg -i a.xg -p p1:0-5 -T) | md5sum)" \
+   "queries alternating between shards are right when only one shard fits"
+is "$(xg -H a.xg -H b.xg -s 99)" "99: " "nodes in no shard have no sequence"
+is "$(xg -H a.xg -H a.xg -s 1 2>&1 | grep -c overlaps)" "1" "shards with overlapping IDs are rejected"
+head -c 100 b.xg > bad.xg
+is "$(xg -H a.xg -H bad.xg -s 1 2>&1 | grep -c 'error: could not load shard bad.xg')" "1" "shards that fail to load are reported"
+
+rm -f a.xg b.xg b.gfa bad.xg